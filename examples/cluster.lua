@@ -0,0 +1,29 @@
+local pulsar = require 'pulsar'
+
+local cluster = pulsar.cluster(4, function(id, nthreads)
+	local pulsar = require 'pulsar'
+	local loop = pulsar.defaultLoop()
+
+	local serv, err = loop:tcpServer("127.0.0.1", 2525, function(client)
+		client:startRead()
+		client:send("Hello from thread "..id.."/"..nthreads.."\n")
+		while client:connected() do
+			local line = client:readUntil('\n')
+			if not line or line == "quit" then break end
+			client:send(line.."\n")
+		end
+	end, {reuseport=true})
+	if not serv then print("Thread "..id.." could not listen", err) return end
+	serv:start()
+	loop:run()
+end)
+
+local loop = pulsar.defaultLoop()
+local timer = loop:timer(5, 5, function(timer) while true do
+	for _, t in ipairs(cluster:stats()) do
+		print(("thread %d: %d accepts, %d clients"):format(t.id, t.accepts, t.clients))
+	end
+	timer:next()
+end end)
+timer:start()
+loop:run()
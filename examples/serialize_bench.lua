@@ -0,0 +1,57 @@
+local pulsar = require 'pulsar'
+
+-- The Lua source text format spawns used to exchange values in, for comparison
+local function text_serialize(v, out)
+	local t = type(v)
+	if t == "string" then out[#out+1] = ("%q"):format(v)
+	elseif t == "number" or t == "boolean" or t == "nil" then out[#out+1] = tostring(v)
+	elseif t == "table" then
+		out[#out+1] = "{"
+		for k, e in pairs(v) do
+			out[#out+1] = "[" text_serialize(k, out) out[#out+1] = "]=" text_serialize(e, out) out[#out+1] = ",\n"
+		end
+		out[#out+1] = "}"
+	end
+	return out
+end
+local function text_encode(v) return "return "..table.concat(text_serialize(v, {})) end
+local function text_decode(s) return loadstring(s)() end
+
+local function bench(name, v, n)
+	local start = os.clock()
+	for i = 1, n do text_decode(text_encode(v)) end
+	local text = os.clock() - start
+
+	start = os.clock()
+	for i = 1, n do pulsar.decode(pulsar.encode(v)) end
+	local binary = os.clock() - start
+
+	print(("%-22s text %8.3fs  binary %8.3fs  (x%.1f)"):format(name, text, binary, text / binary))
+end
+
+local big = {}
+for i = 1, 100000 do big[i] = i * 1.5 end
+local dict = {}
+for i = 1, 20000 do dict["key"..i] = {id=i, name="name"..i, flag=(i % 2 == 0)} end
+
+bench("1 MB string", string.rep("a\n\"\0", 256 * 1024), 20)
+bench("100k numbers array", big, 5)
+bench("20k records", dict, 5)
+
+-- Shared and cyclic tables keep their shape
+local shared = {1, 2, 3}
+local cycle = {shared=shared, again=shared}
+cycle.self = cycle
+local copy = pulsar.decode(pulsar.encode(cycle))
+assert(copy.self == copy and copy.shared == copy.again and copy.shared[3] == 3)
+
+-- Round trip through a spawn
+local loop = pulsar.defaultLoop()
+local echo = loop:spawn(function(...) return ... end)
+local timer = loop:timer(0, 0, function(timer)
+	local start = os.clock()
+	for i = 1, 5 do echo(big) end
+	print(("%-22s %8.3fs"):format("spawn echo 100k x5", os.clock() - start))
+end)
+timer:start()
+loop:run()
@@ -0,0 +1,20 @@
+local pulsar = require 'pulsar'
+local loop = pulsar.defaultLoop()
+
+-- Forwards connections on port 8080 to port 3000, the data never goes through Lua
+local worker = loop:worker()
+local server = loop:tcpServer("127.0.0.1", 8080, function(client)
+	local upstream, err = loop:tcpClient("127.0.0.1", 3000, {connect=5})
+	if not upstream then print("Could not connect upstream", err) return end
+
+	-- The way back runs in its own coroutine
+	worker:register(function()
+		local bytes, reason = upstream:pipeTo(client, {bufsize=128 * 1024})
+		client:close()
+	end)
+	local bytes, reason = client:pipeTo(upstream, {bufsize=128 * 1024})
+	print(("%d bytes forwarded upstream (%s)"):format(bytes, reason))
+	upstream:close()
+end)
+server:start()
+loop:run()
@@ -0,0 +1,22 @@
+local pulsar = require 'pulsar'
+local loop = pulsar.defaultLoop()
+
+-- Echoes every datagram back, handling a whole batch per resume
+local udp, err = loop:udp("127.0.0.1", 5353, {batch=32})
+if not udp then print("Could not listen", err) return end
+
+loop:worker():register(function()
+	while true do
+		local packets = udp:recvBatch(64)
+		if not packets then break end
+		udp:sendBatch(packets)
+	end
+end)
+
+local timer = loop:timer(5, 5, function(timer) while true do
+	local stats = udp:stats()
+	print(("%d received, %d dropped, recvmmsg %s"):format(stats.received, stats.dropped, tostring(stats.recvmmsg)))
+	timer:next()
+end end)
+timer:start()
+loop:run()
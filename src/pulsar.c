@@ -26,6 +26,8 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 #endif
 
 #define DEFAULT_BUFFER_SIZE	1024
+#define DEFAULT_READ_SIZE	(64 * 1024)
+#define MIN_READ_SIZE		(4 * 1024)
 #define WAIT_LEN_UNTIL		-1
 
 /*
@@ -84,704 +86,3994 @@ static int pulsar_panic_main(lua_State *L) {
 	return 0;
 }
 
-static void buf_alloc(uv_handle_t* tcp, size_t size, uv_buf_t *b) {
-	b->len = DEFAULT_BUFFER_SIZE;
-	b->base = (char*)malloc(sizeof(char) * DEFAULT_BUFFER_SIZE);
+/**************************************************************************************
+ ** Buffer pool
+ **************************************************************************************/
+/*
+** Each loop keeps free lists of power of two sized slabs, from 1 KiB to 1 MiB.
+** Bigger buffers are plain mallocs.
+*/
+static int buffer_pool_class(size_t len, size_t *size) {
+	int class = 0;
+	size_t csize = 1 << PULSAR_POOL_MIN_SHIFT;
+	while (csize < len) {
+		csize <<= 1;
+		class++;
+	}
+	*size = csize;
+	if (class >= PULSAR_POOL_CLASSES) return -1;
+	return class;
+}
+
+static char *buffer_pool_get(pulsar_buffer_pool *pool, size_t len, size_t *size) {
+	int class = buffer_pool_class(len, size);
+	if ((class >= 0) && pool->free[class]) {
+		pulsar_buffer_slab *slab = pool->free[class];
+		pool->free[class] = slab->next;
+		pool->nb_free[class]--;
+		pool->hits++;
+		return (char*)slab;
+	}
+	pool->misses++;
+	return malloc(*size);
 }
 
-static void buf_free(uv_buf_t *b) {
-	free(b->base);
+static void buffer_pool_put(pulsar_buffer_pool *pool, char *buf, size_t size) {
+	size_t csize;
+	int class = buffer_pool_class(size, &csize);
+	if ((class < 0) || (csize != size) || (pool->nb_free[class] >= PULSAR_POOL_MAX_FREE)) {
+		free(buf);
+		return;
+	}
+	pulsar_buffer_slab *slab = (pulsar_buffer_slab*)buf;
+	slab->next = pool->free[class];
+	pool->free[class] = slab;
+	pool->nb_free[class]++;
+}
+
+static void buffer_pool_init(pulsar_buffer_pool *pool) {
+	int i;
+	for (i = 0; i < PULSAR_POOL_CLASSES; i++) {
+		pool->free[i] = NULL;
+		pool->nb_free[i] = 0;
+	}
+	pool->hits = 0;
+	pool->misses = 0;
+}
+
+static void buffer_pool_free(pulsar_buffer_pool *pool) {
+	int i;
+	for (i = 0; i < PULSAR_POOL_CLASSES; i++) {
+		while (pool->free[i]) {
+			pulsar_buffer_slab *slab = pool->free[i];
+			pool->free[i] = slab->next;
+			free(slab);
+		}
+		pool->nb_free[i] = 0;
+	}
 }
 
 /**************************************************************************************
- ** TCP Client calls
+ ** Read buffers
  **************************************************************************************/
-static void pulsar_client_resume(pulsar_tcp_client *client, lua_State *L, int nargs);
+/*
+** Receive buffers keep a read and a write cursor: consuming data only moves the read
+** cursor, the data is moved back to the front only when the free space at the end
+** is not enough and growth is geometric so that large reads do not go quadratic.
+** Storage comes from the loop's buffer pool and goes back to it once drained.
+*/
+#define read_buffer_size(b)	((b)->wpos - (b)->rpos)
+#define read_buffer_data(b)	((b)->buf + (b)->rpos)
+
+static void read_buffer_init(pulsar_read_buffer *b) {
+	b->buf = NULL;
+	b->buflen = 0;
+	b->rpos = 0;
+	b->wpos = 0;
+}
 
-static void close_cb(uv_handle_t* handle) {
-	free((void*)handle);
+static void read_buffer_free(pulsar_buffer_pool *pool, pulsar_read_buffer *b) {
+	if (b->buf) buffer_pool_put(pool, b->buf, b->buflen);
+	read_buffer_init(b);
 }
 
-static void client_close(pulsar_tcp_client *client) {
-	if (client->closed) return;
-	client->closed = true;
+// Give back the storage of an empty buffer so idle clients do not hold slabs
+static void read_buffer_trim(pulsar_buffer_pool *pool, pulsar_read_buffer *b) {
+	if (b->buf && !read_buffer_size(b)) read_buffer_free(pool, b);
+}
 
-	// Resume waiting coroutines so that they can fail
-	if (client->read_wait_len) {
-		client->read_wait_len = 0;
-		if (lua_status(client->rL) == LUA_YIELD) {
-			lua_pushnil(client->rL);
-			lua_pushliteral(client->rL, "disconnected");
-			pulsar_client_resume(client, client->rL, 2);
-			luaL_unref(client->rL, LUA_REGISTRYINDEX, client->rL_ref);
-		}
+// Make sure at least len bytes can be written at the write cursor
+static char *read_buffer_reserve(pulsar_buffer_pool *pool, pulsar_read_buffer *b, size_t len) {
+	if (b->buflen - b->wpos >= len) return b->buf + b->wpos;
+
+	size_t used = read_buffer_size(b);
+	if (used + len <= b->buflen) {
+		memmove(b->buf, b->buf + b->rpos, used);
+	} else {
+		size_t newlen = b->buflen * 2;
+		if (newlen < used + len) newlen = used + len;
+		char *newbuf = buffer_pool_get(pool, newlen, &newlen);
+		if (used) memcpy(newbuf, b->buf + b->rpos, used);
+		if (b->buf) buffer_pool_put(pool, b->buf, b->buflen);
+		b->buf = newbuf;
+		b->buflen = newlen;
 	}
+	b->rpos = 0;
+	b->wpos = used;
+	return b->buf + b->wpos;
+}
 
-	if (client->active) uv_read_stop((uv_stream_t*)client->sock);
-	client->active = false;
-	client->disconnected = true;
-	uv_close((uv_handle_t*)client->sock, close_cb);
+static void read_buffer_commit(pulsar_read_buffer *b, size_t len) {
+	b->wpos += len;
+}
 
-	if (client->read_buf) free(client->read_buf);
-	client->read_buf = NULL;
+static void read_buffer_consume(pulsar_read_buffer *b, size_t len) {
+	b->rpos += len;
+	if (b->rpos == b->wpos) b->rpos = b->wpos = 0;
 }
 
-static void pulsar_client_resume(pulsar_tcp_client *client, lua_State *L, int nargs) {
-	if (client->closed) return;
-	int ret = lua_resume(L, nargs);
-	// More to do
-	if (!ret) return;
-	if (ret == LUA_YIELD) return;
-	if (!client) return;
-	if (client->standalone) return;
+/**************************************************************************************
+ ** Byte buffers
+ **************************************************************************************/
+/*
+** pulsar.buffer userdata own their memory so that sockets can read into it and write
+** from it without going through Lua strings, and spawns can take it over from the
+** calling thread instead of copying it.
+*/
+static void buffer_createmeta(lua_State *L);
+
+static pulsar_buffer *pulsar_tobuffer(lua_State *L, int idx) {
+	pulsar_buffer *b = (pulsar_buffer *)lua_touserdata(L, idx);
+	if (!b || !lua_getmetatable(L, idx)) return NULL;
+	luaL_getmetatable(L, MT_PULSAR_BUFFER);
+	if (!lua_rawequal(L, -1, -2)) b = NULL;
+	lua_pop(L, 2);
+	return b;
+}
 
-	// Finished, end the client
-/*	if (!ret) {
-		printf("Closing at resume %lx\n", client);
-		client_close(client);
-		// Let the rest free up by GC
-		return;
+// Make sure at least len more bytes fit after the data, NULL if it could not grow
+static char *buffer_reserve(pulsar_buffer *b, size_t len) {
+	if (b->cap - b->len < len) {
+		size_t cap = b->cap ? b->cap * 2 : DEFAULT_BUFFER_SIZE;
+		while (cap - b->len < len) cap *= 2;
+		char *data = realloc(b->data, cap);
+		if (!data) return NULL;
+		b->data = data;
+		b->cap = cap;
 	}
+	return b->data + b->len;
+}
+
+static void buffer_append(pulsar_buffer *b, const char *data, size_t len) {
+	memcpy(buffer_reserve(b, len), data, len);
+	b->len += len;
+}
+
+/*
+** Push a new buffer taking ownership of data
 */
-	if (ret == LUA_ERRRUN) {
-		printf("Error while running client's coroutine (fd): %s\n", lua_tostring(L, -1));
-		stackDump(L);
-		traceback(L);
-		printf("Closing at error %lx\n", client);
-		client_close(client);
-		// Let the rest free up by GC
-		return;
-	}
+static pulsar_buffer *pulsar_buffer_push(lua_State *L, char *data, size_t len, size_t cap) {
+	pulsar_buffer *b = (pulsar_buffer*)lua_newuserdata(L, sizeof(pulsar_buffer));
+	pulsar_setmeta(L, MT_PULSAR_BUFFER);
+	b->data = data;
+	b->len = len;
+	b->cap = cap;
+	b->pins = 0;
+	return b;
 }
 
-static int pulsar_tcp_client_close(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	client_close(client);
-	return 0;
+static pulsar_buffer *buffer_check_unpinned(lua_State *L, int idx) {
+	pulsar_buffer *b = (pulsar_buffer *)luaL_checkudata (L, idx, MT_PULSAR_BUFFER);
+	if (b->pins) { lua_pushstring(L, "buffer is in use by a read or a send"); lua_error(L); }
+	return b;
 }
 
-static int pulsar_tcp_client_is_connected(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	lua_pushboolean(L, !client->closed && client->active && !client->disconnected);
+static int pulsar_buffer_len(lua_State *L) {
+	pulsar_buffer *b = (pulsar_buffer *)luaL_checkudata (L, 1, MT_PULSAR_BUFFER);
+	lua_pushnumber(L, b->len);
 	return 1;
 }
-static int pulsar_tcp_client_has_data(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	lua_pushboolean(L, !client->closed && client->read_buf_pos > 0);
+
+static int pulsar_buffer_capacity(lua_State *L) {
+	pulsar_buffer *b = (pulsar_buffer *)luaL_checkudata (L, 1, MT_PULSAR_BUFFER);
+	lua_pushnumber(L, b->cap);
 	return 1;
 }
 
-static void tcp_client_send_cb(uv_write_t *_req, int status){
-	pulsar_tcp_client_send_chain *req = (pulsar_tcp_client_send_chain*)_req;
-	pulsar_tcp_client *client = req->client;
-
-	//free(req->buf.base);
-	if (!req->nowait) {
-		lua_pushnumber(req->sL, req->buf.len);
-		pulsar_client_resume(client, req->sL, 1);
+static int pulsar_buffer_append(lua_State *L) {
+	pulsar_buffer *b = buffer_check_unpinned(L, 1);
+	pulsar_buffer *from = pulsar_tobuffer(L, 2);
+	if (from) {
+		buffer_append(b, from->data, from->len);
+	} else {
+		size_t len;
+		const char *data = luaL_checklstring(L, 2, &len);
+		buffer_append(b, data, len);
 	}
-	luaL_unref(req->sL, LUA_REGISTRYINDEX, req->data_ref);
-	luaL_unref(req->sL, LUA_REGISTRYINDEX, req->sL_ref);
+	lua_settop(L, 1);
+	return 1;
+}
 
-	free(req);
+static int pulsar_buffer_clear(lua_State *L) {
+	pulsar_buffer *b = buffer_check_unpinned(L, 1);
+	b->len = 0;
+	return 0;
 }
 
-static int pulsar_tcp_client_send(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (client->closed) return 0;
-	size_t datalen;
-	const char *data = lua_tolstring(L, 2, &datalen);
-	bool nowait = lua_toboolean(L, 3);
+// Same indices as string.sub
+static int pulsar_buffer_tostring(lua_State *L) {
+	pulsar_buffer *b = (pulsar_buffer *)luaL_checkudata (L, 1, MT_PULSAR_BUFFER);
+	ssize_t len = b->len;
+	ssize_t i = luaL_optnumber(L, 2, 1);
+	ssize_t j = luaL_optnumber(L, 3, -1);
+	if (i < 0) i += len + 1;
+	if (j < 0) j += len + 1;
+	if (i < 1) i = 1;
+	if (j > len) j = len;
+	if (i > j) lua_pushliteral(L, "");
+	else lua_pushlstring(L, b->data + i - 1, j - i + 1);
+	return 1;
+}
 
-	pulsar_tcp_client_send_chain *req = (pulsar_tcp_client_send_chain*)malloc(sizeof(pulsar_tcp_client_send_chain));
-	req->client = client;
-	req->buf.len = datalen;
-	req->buf.base = (char*)data;
+static int pulsar_buffer_free(lua_State *L) {
+	pulsar_buffer *b = (pulsar_buffer *)luaL_checkudata (L, 1, MT_PULSAR_BUFFER);
+	if (b->data) free(b->data);
+	b->data = NULL;
+	b->len = b->cap = 0;
+	return 0;
+}
 
-	uv_write((uv_write_t*)req, (uv_stream_t*)client->sock, &req->buf, 1, tcp_client_send_cb);
+static int pulsar_buffer_new(lua_State *L) {
+	size_t len = 0;
+	const char *data = NULL;
+	size_t cap = 0;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		data = lua_tolstring(L, 1, &len);
+		cap = len;
+	}
+	else cap = luaL_optnumber(L, 1, 0);
 
-	lua_pushthread(L); req->sL = lua_tothread(L, -1); req->sL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	req->nowait = nowait;
+	pulsar_buffer *b = pulsar_buffer_push(L, NULL, 0, 0);
+	if (cap) buffer_reserve(b, cap);
+	if (len) buffer_append(b, data, len);
+	return 1;
+}
 
-	lua_pushvalue(L, 2);
-	req->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	
-	if (nowait) return 0;
-	else return lua_yield(L, 0);
-	return 0;
+/**************************************************************************************
+ ** Coroutines pool
+ **************************************************************************************/
+/*
+** Coroutines that finished running are reset and kept by the loop to run the next
+** handler, so that the steady state does not create threads for the GC to collect.
+*/
+static void co_pool_init(pulsar_co_pool *pool) {
+	pool->threads = NULL;
+	pool->refs = NULL;
+	pool->nb = 0;
+	pool->size = 0;
+	pool->max = PULSAR_CO_POOL_MAX;
+	pool->high_water = 0;
+	pool->created = 0;
+	pool->reused = 0;
 }
 
-static void tcp_client_read_cb(uv_stream_t *watcher, ssize_t read, const uv_buf_t *buf){
-	pulsar_tcp_client *client = (pulsar_tcp_client *)watcher->data;
-	if (client->closed) return;
+static void co_pool_free(pulsar_co_pool *pool) {
+	if (pool->threads) free(pool->threads);
+	if (pool->refs) free(pool->refs);
+	pool->threads = NULL;
+	pool->refs = NULL;
+	pool->nb = 0;
+	pool->size = 0;
+}
 
-	if (read < 0)
-	{
-		client_close(client);
-		return;
+/*
+** Get a coroutine, anchored in the registry by *ref
+*/
+static lua_State *pulsar_co_acquire(pulsar_loop *loop, lua_State *L, int *ref) {
+	pulsar_co_pool *pool = &loop->co_pool;
+	if (pool->nb) {
+		pool->nb--;
+		pool->reused++;
+		*ref = pool->refs[pool->nb];
+		return pool->threads[pool->nb];
 	}
-	if (read == 0) return;
-	
-	if (client->read_buf_len - client->read_buf_pos < read) {
-		char *newbuf = malloc(client->read_buf_len + read);
-		memcpy(newbuf, client->read_buf, client->read_buf_pos);
-		free(client->read_buf);
-		client->read_buf = newbuf;
-		client->read_buf_len += read;
-	}
-
-	memcpy(client->read_buf + client->read_buf_pos, buf->base, read);
-	buf_free((uv_buf_t*)buf);
-
-	client->read_buf_pos += read;
-
-	if ((client->read_buf_pos) && (client->read_wait_len > 0) && (client->read_buf_pos >= client->read_wait_len)) {
-		lua_pushlstring(client->rL, client->read_buf, client->read_wait_len);
-		char *newbuf = malloc(client->read_buf_len);
-		if (client->read_buf_pos > client->read_wait_len) memcpy(newbuf, client->read_buf + client->read_wait_len, client->read_buf_pos - client->read_wait_len);
-		free(client->read_buf);
-		client->read_buf = newbuf;
-		client->read_buf_pos -= client->read_wait_len;
-		client->read_wait_len = 0;
 
-		pulsar_client_resume(client, client->rL, 1);
-		luaL_unref(client->rL, LUA_REGISTRYINDEX, client->rL_ref);
+	lua_State *co = lua_newthread(L);
+	lua_atpanic(co, pulsar_panic);
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pool->created++;
+	return co;
+}
+
+/*
+** Give back a coroutine, it is only kept if it finished running without error
+*/
+static void pulsar_co_release(pulsar_loop *loop, lua_State *co, int ref) {
+	pulsar_co_pool *pool = &loop->co_pool;
+	if ((lua_status(co) != 0) || (pool->nb >= pool->max)) {
+		luaL_unref(co, LUA_REGISTRYINDEX, ref);
 		return;
 	}
 
-	if ((client->read_buf_pos) && (client->read_wait_len == WAIT_LEN_UNTIL)) {
-		size_t len = strlen(client->read_wait_until);
-		const char *until = client->read_wait_until;
-		size_t ignorelen = client->read_wait_ignorelen;
-		const char *ignore = client->read_wait_ignore;
-		size_t pos = 0;
-		while (pos <= client->read_buf_pos - len) {
-			if (!memcmp(client->read_buf + pos, until, len)) {
-				if (ignorelen && (ignorelen <= pos) && !memcmp(client->read_buf + pos - ignorelen, ignore, ignorelen))
-					lua_pushlstring(client->rL, client->read_buf, pos - ignorelen);
-				else {
-					lua_pushlstring(client->rL, client->read_buf, pos);
-				}
-
-				char *newbuf = malloc(client->read_buf_len);
-				if (client->read_buf_pos > pos + len) memcpy(newbuf, client->read_buf + pos + len, client->read_buf_pos - pos - len);
-				free(client->read_buf);
-				client->read_buf = newbuf;
-				client->read_buf_pos -= pos + len;
-				client->read_wait_len = 0;
-				free(client->read_wait_until);
-				if (client->read_wait_ignorelen) free(client->read_wait_ignore);
-				client->read_wait_ignore = NULL;
-				client->read_wait_ignorelen = 0;
-				client->read_wait_until = NULL;
-
-				pulsar_client_resume(client, client->rL, 1);
-				luaL_unref(client->rL, LUA_REGISTRYINDEX, client->rL_ref);
-				return;
-			}
-			pos++;
-		}
+	lua_settop(co, 0);
+	if (pool->nb == pool->size) {
+		pool->size = pool->size ? pool->size * 2 : 16;
+		pool->threads = realloc(pool->threads, pool->size * sizeof(lua_State*));
+		pool->refs = realloc(pool->refs, pool->size * sizeof(int));
 	}
+	pool->threads[pool->nb] = co;
+	pool->refs[pool->nb] = ref;
+	pool->nb++;
+	if (pool->nb > pool->high_water) pool->high_water = pool->nb;
 }
 
-static int pulsar_tcp_client_read(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (!client->active || client->closed) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "client read not active");
-		return 2;
-	}
+/**************************************************************************************
+ ** Metrics
+ **************************************************************************************/
+#define metrics_resume(loop, kind)	((loop)->metrics.resumes[kind]++)
+
+static const char *metrics_resume_names[PULSAR_RESUME_KINDS] = { "client", "timer", "idle", "worker", "spawn", "task" };
+
+// Bucket i counts durations under 2^i us
+static void hist_add(pulsar_histogram *h, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	int i = 0;
+	while ((i < PULSAR_HIST_BUCKETS - 1) && (us >> i)) i++;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += us;
+	if (us > h->max) h->max = us;
+}
 
-	int len = luaL_checknumber(L, 2);
-	if (len == 0) {
-		lua_pushliteral(L, "");
-		return 1;
+// Upper bound, in ms, of the bucket the given fraction of the values falls under
+static double hist_percentile(pulsar_histogram *h, double p) {
+	if (!h->count) return 0;
+	uint64_t rank = h->count * p, seen = 0;
+	int i;
+	for (i = 0; i < PULSAR_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) break;
 	}
+	double bound = (i < PULSAR_HIST_BUCKETS) ? (double)(1ULL << i) / 1000.0 : 0;
+	return (bound < h->max / 1000.0) ? bound : h->max / 1000.0;
+}
 
-	// No need to wait, we already have enough data
-	if (len <= client->read_buf_pos) {
-		lua_pushlstring(L, client->read_buf, len);
-		char *newbuf = malloc(client->read_buf_len);
-		if (client->read_buf_pos > len) memcpy(newbuf, client->read_buf + len, client->read_buf_pos - len);
-		free(client->read_buf);
-		client->read_buf = newbuf;
-		client->read_buf_pos -= len;
-		return 1;
+static void hist_push(lua_State *L, pulsar_histogram *h) {
+	lua_newtable(L);
+	lua_pushnumber(L, h->count); lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->count ? h->sum / 1000.0 / h->count : 0); lua_setfield(L, -2, "avg");
+	lua_pushnumber(L, h->max / 1000.0); lua_setfield(L, -2, "max");
+	lua_pushnumber(L, hist_percentile(h, 0.5)); lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, hist_percentile(h, 0.9)); lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, hist_percentile(h, 0.99)); lua_setfield(L, -2, "p99");
+
+	// Counts per bucket, keyed by the bucket's upper bound in ms
+	lua_newtable(L);
+	int i;
+	for (i = 0; i < PULSAR_HIST_BUCKETS; i++) {
+		if (!h->buckets[i]) continue;
+		lua_pushnumber(L, (double)(1ULL << i) / 1000.0);
+		lua_pushnumber(L, h->buckets[i]);
+		lua_rawset(L, -3);
 	}
+	lua_setfield(L, -2, "buckets");
+}
 
-	lua_pushthread(L); client->rL = lua_tothread(L, -1); client->rL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	client->read_wait_len = len;
-	return lua_yield(L, 0);
+// Gauges describe the current state, only counters and histograms start again from zero
+static void metrics_reset(pulsar_metrics *m) {
+	m->accepts = m->accept_errors = 0;
+	m->bytes_read = m->bytes_written = 0;
+	m->clients_total = 0;
+	memset(m->resumes, 0, sizeof(m->resumes));
+	m->timer_fires = 0;
+	m->spawns = 0;
+	memset(&m->spawn_wait, 0, sizeof(pulsar_histogram));
+	memset(&m->spawn_run, 0, sizeof(pulsar_histogram));
+	m->slow_resumes = 0;
+	memset(&m->resume_time, 0, sizeof(pulsar_histogram));
+	memset(&m->loop_lag, 0, sizeof(pulsar_histogram));
 }
 
-static int pulsar_tcp_client_read_until(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (!client->active || client->closed) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "client read not active");
-		return 2;
-	}
+/**************************************************************************************
+ ** Monitor
+ **************************************************************************************/
+static uv_once_t monitor_once = UV_ONCE_INIT;
+static uv_key_t monitor_key;
 
-	size_t len;
-	const char *until = luaL_checklstring(L, 2, &len);
-	if (len < 1) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "empty until");
-		return 2;
+static void monitor_key_init(void) {
+	uv_key_create(&monitor_key);
+}
+
+// Same as traceback() but into buf, truncated to its size
+static void monitor_traceback(lua_State *L, char *buf, size_t size) {
+	lua_Debug ar;
+	size_t pos = 0;
+	int level = 0;
+	buf[0] = 0;
+	while ((pos < size) && lua_getstack(L, level++, &ar)) {
+		lua_getinfo(L, "nSl", &ar);
+		int n = snprintf(buf + pos, size - pos, "\tAt %s:%d %s\n", ar.short_src, ar.currentline, ar.name ? ar.name : "");
+		if (n < 0) break;
+		pos += n;
 	}
-	size_t ignorelen = 0;
-	const char *ignore = NULL;
-	if (lua_isstring(L, 3)) ignore = lua_tolstring(L, 3, &ignorelen);
+	if (!pos) snprintf(buf, size, "\t(coroutine finished)\n");
+}
 
-	// No need to wait, we may have enough data
-	if (len <= client->read_buf_pos) {
-		size_t pos = 0;
-		while (pos <= client->read_buf_pos - len) {
-			if (!memcmp(client->read_buf + pos, until, len)) {
-				if (ignorelen && (ignorelen <= pos) && !memcmp(client->read_buf + pos - ignorelen, ignore, ignorelen))
-					lua_pushlstring(L, client->read_buf, pos - ignorelen);
-				else
-					lua_pushlstring(L, client->read_buf, pos);
-				char *newbuf = malloc(client->read_buf_len);
-				if (client->read_buf_pos > pos + len) memcpy(newbuf, client->read_buf + pos + len, client->read_buf_pos - pos - len);
-				free(client->read_buf);
-				client->read_buf = newbuf;
-				client->read_buf_pos -= pos + len;
-				return 1;
-			}
-			pos++;
-		}
+// Runs every PULSAR_MONITOR_HOOK_COUNT instructions of a monitored resume
+static void monitor_hook(lua_State *L, lua_Debug *ar) {
+	pulsar_resume_frame *frame = (pulsar_resume_frame*)uv_key_get(&monitor_key);
+	if (!frame || (frame->L != L) || frame->traced) return;
+	if (uv_hrtime() - frame->start < frame->loop->monitor.threshold) return;
+	monitor_traceback(L, frame->trace, sizeof(frame->trace));
+	frame->traced = true;
+}
+
+static void monitor_report(pulsar_loop *loop, pulsar_resume_frame *frame, uint64_t elapsed) {
+	pulsar_monitor *mon = &loop->monitor;
+	loop->metrics.slow_resumes++;
+	if ((mon->cb_ref == LUA_NOREF) || mon->reporting) {
+		printf("Slow %s coroutine, resumed for %.3f ms:\n%s", metrics_resume_names[frame->kind], elapsed / 1000000.0, frame->trace);
+		return;
 	}
 
-	lua_pushthread(L); client->rL = lua_tothread(L, -1); client->rL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	client->read_wait_len = WAIT_LEN_UNTIL;
-	client->read_wait_until = malloc((1+strlen(until)) * sizeof(char));
-	strcpy(client->read_wait_until, until);
-	client->read_wait_ignorelen = ignorelen;
-	if (ignorelen) {
-		client->read_wait_ignore = malloc((1+strlen(ignore)) * sizeof(char));
-		strcpy(client->read_wait_ignore, ignore);
+	// The callback must not yield, it is not a coroutine of the loop
+	lua_State *L = mon->L;
+	mon->reporting = true;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, mon->cb_ref);
+	lua_newtable(L);
+	lua_pushstring(L, metrics_resume_names[frame->kind]); lua_setfield(L, -2, "kind");
+	lua_pushnumber(L, elapsed / 1000000.0); lua_setfield(L, -2, "duration");
+	lua_pushstring(L, frame->trace); lua_setfield(L, -2, "traceback");
+	if (lua_pcall(L, 1, 0, 0)) {
+		printf("Error while running monitor callback: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
 	}
-	return lua_yield(L, 0);
+	mon->reporting = false;
 }
 
-static int pulsar_tcp_client_start(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (client->closed) return 0;
-	uv_read_start((uv_stream_t*)client->sock, buf_alloc, tcp_client_read_cb);
-	client->active = true;
-	return 0;
-}
-static int pulsar_tcp_client_stop(lua_State *L) {
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (client->closed) return 0;
-	uv_read_stop((uv_stream_t*)client->sock);
-	client->active = false;
-	return 0;
-}
+/*
+** Every resume of a coroutine owned by the loop goes through here, owner is what it belongs to
+** for the kind, if anything
+*/
+static int loop_resume(pulsar_loop *loop, int kind, void *owner, lua_State *L, int nargs) {
+	metrics_resume(loop, kind);
+	pulsar_owner prev_owner = loop->resuming;
+	loop->resuming.kind = kind;
+	loop->resuming.ptr = owner;
+	loop->resuming.L = L;
+	pulsar_monitor *mon = &loop->monitor;
+	if (!mon->enabled) {
+		int ret = lua_resume(L, nargs);
+		loop->resuming = prev_owner;
+		return ret;
+	}
 
-static int pulsar_tcp_client_getpeername(lua_State *L)
-{
-	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
-	if (client->closed) return 0;
-	struct sockaddr_in peer;
-	int peerlen = sizeof(peer);
-	if (uv_tcp_getpeername(client->sock, (struct sockaddr*)&peer, &peerlen)) {
-		lua_pushnil(L);
-		lua_pushstring(L, "getpeername failed");
-	} else {
-		lua_pushstring(L, inet_ntoa(peer.sin_addr));
-		lua_pushnumber(L, ntohs(peer.sin_port));
+	pulsar_resume_frame frame;
+	frame.loop = loop;
+	frame.L = L;
+	frame.kind = kind;
+	frame.traced = false;
+	frame.prev = (pulsar_resume_frame*)uv_key_get(&monitor_key);
+	uv_key_set(&monitor_key, &frame);
+	if (mon->hook) lua_sethook(L, monitor_hook, LUA_MASKCOUNT, PULSAR_MONITOR_HOOK_COUNT);
+	frame.start = uv_hrtime();
+	int ret = lua_resume(L, nargs);
+	uint64_t elapsed = uv_hrtime() - frame.start;
+	if (mon->hook) lua_sethook(L, NULL, 0, 0);
+	uv_key_set(&monitor_key, frame.prev);
+	loop->resuming = prev_owner;
+
+	hist_add(&loop->metrics.resume_time, elapsed);
+	if (elapsed >= mon->threshold) {
+		// Without the hook, where it yielded or failed still tells which handler it was
+		if (!frame.traced) monitor_traceback(L, frame.trace, sizeof(frame.trace));
+		monitor_report(loop, &frame, elapsed);
 	}
-	return 2;
+	return ret;
 }
 
-static void tcp_client_connect_cb(uv_connect_t *_con, int status) {
-	pulsar_tcp_client_connect *con = (pulsar_tcp_client_connect*)_con;
-	lua_State *L = con->L;
-	if (status) {
-		uv_close((uv_handle_t*)con->sock, close_cb);
-		free(con);
-		lua_pushnil(L);
-		lua_pushstring(L, "could not connect");
-		pulsar_client_resume(NULL, L, 2);
-		return;
+/*
+** Only the coroutine being resumed has a known owner, others like ones started with
+** coroutine.resume are resumed as plain tasks
+*/
+static pulsar_owner loop_owner(pulsar_loop *loop, lua_State *L) {
+	pulsar_owner owner = loop->resuming;
+	if (owner.L != L) {
+		owner.kind = PULSAR_RESUME_TASK;
+		owner.ptr = NULL;
+		owner.L = L;
 	}
+	// The wait queues the worker's task again, its record has to outlive the yield
+	else if (owner.kind == PULSAR_RESUME_WORKER) ((pulsar_idle_worker_chain*)owner.ptr)->held = true;
+	return owner;
+}
 
+// Timer callbacks run late by as long as the loop was kept busy
+static void monitor_lag_cb(uv_timer_t *handle, int status) {
+	pulsar_loop *loop = (pulsar_loop*)handle->data;
+	pulsar_monitor *mon = &loop->monitor;
+	uint64_t now = uv_hrtime();
+	uint64_t expected = mon->interval * 1000000;
+	uint64_t elapsed = now - mon->lag_last;
+	hist_add(&loop->metrics.loop_lag, (elapsed > expected) ? elapsed - expected : 0);
+	mon->lag_last = now;
+}
 
-	// Initialize and start watcher to read client requests
-	pulsar_tcp_client *client = (pulsar_tcp_client*)lua_newuserdata(L, sizeof(pulsar_tcp_client));
-	pulsar_setmeta(L, MT_PULSAR_TCP_CLIENT);
-	client->sock = con->sock;
-	client->sock->data = client;
-	client->loop = con->loop;
-	client->closed = false;
-	client->active = false;
-	client->disconnected = false;
+static void monitor_init(pulsar_monitor *mon) {
+	mon->enabled = false;
+	mon->hook = true;
+	mon->threshold = PULSAR_MONITOR_THRESHOLD * 1000000ULL;
+	mon->interval = PULSAR_MONITOR_INTERVAL;
+	mon->L = NULL;
+	mon->L_ref = LUA_NOREF;
+	mon->cb_ref = LUA_NOREF;
+	mon->reporting = false;
+	mon->lag_timer = NULL;
+	mon->lag_last = 0;
+}
 
-	client->read_wait_ignorelen = 0;
-	client->read_wait_ignore = NULL;
-	client->read_wait_len = 0;
-	client->read_wait_until = NULL;
-	client->read_buf_pos = 0;
-	client->read_buf_len = DEFAULT_BUFFER_SIZE;
-	client->read_buf = malloc(client->read_buf_len * sizeof(char));
+/**************************************************************************************
+ ** Scheduler
+ **************************************************************************************/
+static void sched_prepare_cb(uv_prepare_t *handle, int status);
+static void sched_check_cb(uv_check_t *handle, int status);
+static void sched_idle_cb(uv_idle_t *handle, int status);
+
+static const char *sched_class_names[PULSAR_CLASSES] = { "high", "normal", "bulk" };
+
+static int sched_class_check(lua_State *L, int idx) {
+	const char *name = luaL_checkstring(L, idx);
+	int cls;
+	for (cls = 0; cls < PULSAR_CLASSES; cls++) if (!strcmp(name, sched_class_names[cls])) return cls;
+	lua_pushstring(L, "unknown priority class"); lua_error(L);
+	return PULSAR_CLASS_NORMAL;
+}
 
-	client->standalone = true;
+static void sched_init(pulsar_scheduler *sched, uv_loop_t *loop) {
+	memset(sched, 0, sizeof(pulsar_scheduler));
+	sched->budget = PULSAR_SCHED_BUDGET * 1000000;
+	sched->quantum = PULSAR_SCHED_QUANTUM;
+	uv_prepare_init(loop, &sched->prepare);
+	uv_check_init(loop, &sched->check);
+	uv_idle_init(loop, &sched->idle);
+	sched->prepare.data = sched;
+	sched->check.data = sched;
+	sched->idle.data = sched;
+}
 
-	free(con);
-	pulsar_client_resume(client, L, 1);
+static void sched_start(pulsar_scheduler *sched) {
+	if (sched->running) return;
+	sched->running = true;
+	uv_prepare_start(&sched->prepare, sched_prepare_cb);
+	uv_check_start(&sched->check, sched_check_cb);
+	// Keeps the loop from blocking in poll while wakeups are queued
+	uv_idle_start(&sched->idle, sched_idle_cb);
 }
 
-static int pulsar_tcp_client_new(lua_State *L)
-{
-	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
-	const char *address = luaL_checkstring(L, 2);
-	int port = luaL_checknumber(L, 3);
+static void sched_stop(pulsar_scheduler *sched) {
+	if (!sched->running) return;
+	sched->running = false;
+	uv_prepare_stop(&sched->prepare);
+	uv_check_stop(&sched->check);
+	uv_idle_stop(&sched->idle);
+}
 
-	pulsar_tcp_client_connect *req = (pulsar_tcp_client_connect*)malloc(sizeof(pulsar_tcp_client_connect));
-	req->sock = malloc(uv_handle_size(UV_TCP));
-	uv_tcp_init(loop->loop, req->sock);
-	struct sockaddr_in addr;
-	uv_ip4_addr(address, port, &addr);
-	uv_tcp_connect((uv_connect_t*)req, req->sock, (const struct sockaddr*)&addr, tcp_client_connect_cb);
+static void sched_task_free(pulsar_scheduler *sched, pulsar_task *task) {
+	if (task->L) luaL_unref(task->L, LUA_REGISTRYINDEX, task->L_ref);
+	if (sched->nb_free >= PULSAR_SCHED_POOL_MAX) { free(task); return; }
+	task->next = sched->free;
+	sched->free = task;
+	sched->nb_free++;
+}
 
-	req->loop = loop;
-
-	lua_pushthread(L); req->L = lua_tothread(L, -1); req->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	return lua_yield(L, 0);
-}
-
-/**************************************************************************************
- ** TCP Server calls
- **************************************************************************************/
-static void tcp_server_accept_cb(uv_stream_t *_watcher, int status) {
-	if (status == -1) {
+/*
+** Runs cb right away when the scheduler is off, otherwise queues it at the end of its class.
+** The coroutine, if any, is referenced until it runs, with its nargs values left on its stack
+*/
+static void sched_wakeup(pulsar_loop *loop, int cls, pulsar_task_cb cb, void *data, lua_State *L, int nargs) {
+	pulsar_scheduler *sched = &loop->sched;
+	if (!sched->enabled) {
+		cb(data, L, nargs);
 		return;
 	}
 
-	pulsar_tcp_server *serv = (pulsar_tcp_server *)_watcher->data;
+	pulsar_task *task = sched->free;
+	if (task) {
+		sched->free = task->next;
+		sched->nb_free--;
+	}
+	else task = malloc(sizeof(pulsar_task));
+	task->next = NULL;
+	task->cb = cb;
+	task->data = data;
+	task->L = L;
+	task->nargs = nargs;
+	task->cls = cls;
+	task->queued_at = uv_hrtime();
+	if (L) { lua_pushthread(L); task->L_ref = luaL_ref(L, LUA_REGISTRYINDEX); }
+
+	if (sched->tail[cls]) sched->tail[cls]->next = task;
+	else sched->head[cls] = task;
+	sched->tail[cls] = task;
+	sched->nb[cls]++;
+	sched->queued[cls]++;
+	sched_start(sched);
+}
 
-	// Initialize and start watcher to read client requests
-	lua_rawgeti(serv->L, LUA_REGISTRYINDEX, serv->client_fct_ref);
-	pulsar_tcp_client *client = (pulsar_tcp_client*)lua_newuserdata(serv->L, sizeof(pulsar_tcp_client));
-	pulsar_setmeta(serv->L, MT_PULSAR_TCP_CLIENT);
-	client->loop = serv->loop;
-	client->sock = malloc(uv_handle_size(UV_TCP));
-	uv_tcp_init(serv->loop->loop, client->sock);
-	if (uv_accept(_watcher, (uv_stream_t*)client->sock)) {
-		client->closed = true;
-		uv_close((uv_handle_t*)client->sock, close_cb);
-		lua_pop(serv->L, 2);
-		return;
+// Drops the queued wakeups of an object going away
+static void sched_cancel(pulsar_loop *loop, void *data) {
+	pulsar_scheduler *sched = &loop->sched;
+	int cls;
+	for (cls = 0; cls < PULSAR_CLASSES; cls++) {
+		pulsar_task **prev = &sched->head[cls];
+		sched->tail[cls] = NULL;
+		while (*prev) {
+			pulsar_task *task = *prev;
+			if (task->data == data) {
+				*prev = task->next;
+				sched->nb[cls]--;
+				sched_task_free(sched, task);
+			} else {
+				sched->tail[cls] = task;
+				prev = &task->next;
+			}
+		}
 	}
-	client->sock->data = client;
-	client->active = false;
-	client->disconnected = false;
-	client->closed = false;
+}
 
-	client->read_wait_ignorelen = 0;
-	client->read_wait_ignore = NULL;
-	client->read_wait_len = 0;
-	client->read_wait_until = NULL;
-	client->read_buf_pos = 0;
-	client->read_buf_len = DEFAULT_BUFFER_SIZE;
-	client->read_buf = malloc(client->read_buf_len * sizeof(char));
+static bool sched_run_one(pulsar_scheduler *sched, int cls) {
+	pulsar_task *task = sched->head[cls];
+	if (!task) return false;
+	sched->head[cls] = task->next;
+	if (!sched->head[cls]) sched->tail[cls] = NULL;
+	sched->nb[cls]--;
+
+	uint64_t wait = uv_hrtime() - task->queued_at;
+	sched->wait_total[cls] += wait;
+	if (wait > sched->wait_max[cls]) sched->wait_max[cls] = wait;
+	sched->ran[cls]++;
+
+	// The task goes back to the pool first, the callback may queue new ones
+	pulsar_task_cb cb = task->cb;
+	void *data = task->data;
+	lua_State *L = task->L;
+	int L_ref = task->L_ref;
+	int nargs = task->nargs;
+	task->L = NULL;
+	sched_task_free(sched, task);
+	cb(data, L, nargs);
+	if (L) luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+	return true;
+}
 
-	client->standalone = false;
+/*
+** Higher classes run first until the budget is spent, then each class that got nothing
+** this tick still runs one wakeup so that bulk work can not starve
+*/
+static void sched_drain(pulsar_scheduler *sched) {
+	uint64_t start = uv_hrtime();
+	bool served[PULSAR_CLASSES] = { false };
+	int cls;
+	sched->ticks++;
+	while (uv_hrtime() - start < sched->budget) {
+		// Wakeups queued by the ones that ran are picked up too, highest class first
+		for (cls = 0; (cls < PULSAR_CLASSES) && !sched->head[cls]; cls++);
+		if (cls == PULSAR_CLASSES) break;
+		sched_run_one(sched, cls);
+		served[cls] = true;
+	}
+	if (uv_hrtime() - start >= sched->budget) {
+		sched->exhausted++;
+		for (cls = 0; cls < PULSAR_CLASSES; cls++) if (!served[cls]) sched_run_one(sched, cls);
+	}
 
-	lua_State *L = lua_newthread(serv->L);
-	lua_atpanic(L, pulsar_panic);
-	client->co_ref = luaL_ref(serv->L, LUA_REGISTRYINDEX);
-	lua_xmove(serv->L, L, 2);
-	pulsar_client_resume(client, L, 1);
+	for (cls = 0; cls < PULSAR_CLASSES; cls++) if (sched->head[cls]) return;
+	sched_stop(sched);
 }
 
-static int pulsar_tcp_server_close(lua_State *L) {
-	pulsar_tcp_server *serv = (pulsar_tcp_server *)luaL_checkudata (L, 1, MT_PULSAR_TCP_SERVER);
-	uv_close((uv_handle_t*)serv->sock, close_cb);
-	serv->active = false;
-	luaL_unref(L, LUA_REGISTRYINDEX, serv->client_fct_ref);
-	return 0;
-}
-static int pulsar_tcp_server_start(lua_State *L) {
-	pulsar_tcp_server *serv = (pulsar_tcp_server *)luaL_checkudata (L, 1, MT_PULSAR_TCP_SERVER);
-	uv_listen((uv_stream_t*)serv->sock, 128, tcp_server_accept_cb);
-	serv->active = true;
-	return 0;
+static void sched_prepare_cb(uv_prepare_t *handle, int status) {
+	sched_drain((pulsar_scheduler*)handle->data);
 }
 
-static int pulsar_tcp_server_new(lua_State *L)
-{
-	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
-	const char *address = luaL_checkstring(L, 2);
-	int port = luaL_checknumber(L, 3);
-	if (!lua_isfunction(L, 4)) { lua_pushstring(L, "argument 3 is not a function"); lua_error(L); return 0; }
-
-	struct sockaddr_in bind_addr;
-	uv_ip4_addr(address, port, &bind_addr);
-
-	// Initialize and start a watcher to accepts client requests
-	pulsar_tcp_server *serv = (pulsar_tcp_server*)lua_newuserdata(L, sizeof(pulsar_tcp_server));
-	pulsar_setmeta(L, MT_PULSAR_TCP_SERVER);
-	serv->sock = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
-	serv->sock->data = serv;
-	uv_tcp_init(loop->loop, serv->sock);
-	uv_tcp_bind(serv->sock, (const struct sockaddr*)&bind_addr);
-	serv->L = L;
-	serv->loop = loop;
-	serv->active = false;
+static void sched_check_cb(uv_check_t *handle, int status) {
+	sched_drain((pulsar_scheduler*)handle->data);
+}
 
-	lua_pushvalue(L, 4);
-	serv->client_fct_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	return 1;
+static void sched_idle_cb(uv_idle_t *handle, int status) {
 }
 
-/**************************************************************************************
- ** Timers
- **************************************************************************************/
-static void pulsar_timer_resume(pulsar_timer *timer, lua_State *L, int nargs) {
-	int ret = lua_resume(L, nargs);
+// Resumes a coroutine that nothing else owns, data is the loop
+static void co_task_cb(void *data, lua_State *L, int nargs) {
+	int ret = loop_resume((pulsar_loop*)data, PULSAR_RESUME_TASK, NULL, L, nargs);
 	if (ret == LUA_ERRRUN) {
-		printf("Error while running timer's coroutine: %s\n", lua_tostring(L, -1));
+		printf("Error while running coroutine: %s\n", lua_tostring(L, -1));
 		traceback(L);
-
-		if (timer->active) uv_timer_stop(timer->w_timeout);
-		timer->active = false;
-		return;
 	}
 }
 
-static void timer_cb(uv_timer_t *_watcher, int status) {
-	pulsar_timer *timer = (pulsar_timer *)_watcher->data;
+static void owner_wakeup(pulsar_loop *loop, pulsar_owner *owner, lua_State *L, int nargs);
 
-	uv_timer_stop(timer->w_timeout);
-	timer->active = false;
-	if (timer->first_run) {
-		timer->first_run = false;
-		pulsar_timer_resume(timer, timer->L, 1);
-	} else {
-		pulsar_timer_resume(timer, timer->L, 0);
+static void sched_free(pulsar_scheduler *sched) {
+	int cls;
+	for (cls = 0; cls < PULSAR_CLASSES; cls++) {
+		while (sched->head[cls]) {
+			pulsar_task *task = sched->head[cls];
+			sched->head[cls] = task->next;
+			if (task->L) luaL_unref(task->L, LUA_REGISTRYINDEX, task->L_ref);
+			free(task);
+		}
+		sched->tail[cls] = NULL;
+		sched->nb[cls] = 0;
+	}
+	while (sched->free) {
+		pulsar_task *task = sched->free;
+		sched->free = task->next;
+		free(task);
 	}
+	sched->nb_free = 0;
+	sched_stop(sched);
+	uv_close((uv_handle_t*)&sched->prepare, NULL);
+	uv_close((uv_handle_t*)&sched->check, NULL);
+	uv_close((uv_handle_t*)&sched->idle, NULL);
 }
 
-static int pulsar_timer_close(lua_State *L) {
-	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
-	if (timer->active) uv_timer_stop(timer->w_timeout);
-	uv_close((uv_handle_t*)timer->w_timeout, close_cb);
-	timer->active = false;
-	luaL_unref(L, LUA_REGISTRYINDEX, timer->co_ref);
-	return 0;
-}
-static int pulsar_timer_start(lua_State *L) {
-	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
-	uv_timer_start(timer->w_timeout, timer_cb, timer->timeout, timer->repeat);
-	timer->active = true;
-	return 0;
-}
-static int pulsar_timer_stop(lua_State *L) {
-	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
-	if (timer->active) uv_timer_stop(timer->w_timeout);
-	timer->active = false;
-	return 0;
-}
-static int pulsar_timer_next(lua_State *L) {
-	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
-	uv_timer_again(timer->w_timeout);
-	timer->active = true;
-	return lua_yield(L, 0);
-}
+/**************************************************************************************
+ ** Timer wheel
+ **************************************************************************************/
+/*
+** Deadlines are kept in a hierarchical timing wheel with a 1ms tick: 4 levels of 256 slots,
+** each slot of level n covering 256^n ms. Adding or removing a deadline is O(1), entries
+** move down a level each time the level below wraps around and a single uv_timer wakes
+** the loop up for the next used slot.
+*/
+#define WHEEL_SPAN		((uint64_t)1 << (PULSAR_WHEEL_BITS * PULSAR_WHEEL_LEVELS))
 
-static int pulsar_timer_new(lua_State *L)
-{
-	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
-	float first = luaL_checknumber(L, 2);
-	float repeat = luaL_checknumber(L, 3);
-	if (!lua_isfunction(L, 4)) { lua_pushstring(L, "argument 3 is not a function"); lua_error(L); return 0; }
+static void wheel_timer_cb(uv_timer_t *handle, int status);
 
-	// Initialize and start a watcher to accepts client requests
-	pulsar_timer *timer = (pulsar_timer*)lua_newuserdata(L, sizeof(pulsar_timer));
-	pulsar_setmeta(L, MT_PULSAR_TIMER);
-	timer->loop = loop;
-	timer->active = false;
-	timer->first_run = true;
+// Rounded up so that nothing ever fires early
+static uint64_t wheel_ms(double seconds) {
+	if (seconds <= 0) return 0;
+	double ms = seconds * 1000;
+	uint64_t ims = (uint64_t)ms;
+	if (ims < ms) ims++;
+	return ims;
+}
 
-	timer->L = lua_newthread(L);
-	lua_atpanic(timer->L, pulsar_panic);
-	lua_pushvalue(L, 4);
-	lua_pushvalue(L, 5);
-	lua_xmove(L, timer->L, 2);
+static void wheel_init(pulsar_wheel *w, uv_loop_t *loop) {
+	memset(w, 0, sizeof(pulsar_wheel));
+	uv_timer_init(loop, &w->timer);
+	w->timer.data = w;
+	w->now = uv_now(loop);
+}
 
-	timer->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	timer->timeout = (int)(first * 1000);
-	timer->repeat = (int)(repeat * 1000);
+static bool wheel_empty(pulsar_wheel *w) {
+	int level;
+	for (level = 0; level < PULSAR_WHEEL_LEVELS; level++) if (w->nb[level]) return false;
+	return true;
+}
 
-	timer->w_timeout = (uv_timer_t*)malloc(sizeof(uv_timer_t));
-	timer->w_timeout->data = timer;
-	uv_timer_init(loop->loop, timer->w_timeout);
-	return 1;
+static void wheel_link(pulsar_wheel *w, pulsar_wheel_node *node) {
+	uint64_t delta = node->expires - w->now;
+	uint64_t expires = node->expires;
+	int level = 0;
+	while ((level < PULSAR_WHEEL_LEVELS - 1) && (delta >> (PULSAR_WHEEL_BITS * (level + 1)))) level++;
+	// Too far even for the last level, park it in its farthest slot until it comes around
+	if (delta >= WHEEL_SPAN) expires = w->now + WHEEL_SPAN - 1;
+
+	int slot = (expires >> (PULSAR_WHEEL_BITS * level)) & PULSAR_WHEEL_MASK;
+	pulsar_wheel_node **head = &w->slots[level][slot];
+	node->level = level;
+	node->slot = slot;
+	node->next = *head;
+	if (*head) (*head)->pprev = &node->next;
+	*head = node;
+	node->pprev = head;
+	w->bitmap[level][slot >> 6] |= (uint64_t)1 << (slot & 63);
+	w->nb[level]++;
 }
 
-/**************************************************************************************
- ** Idles
- **************************************************************************************/
-static void pulsar_idle_resume(pulsar_idle *idle, lua_State *L, int nargs) {
-	int ret = lua_resume(L, nargs);
-	// More to do
-	if (ret == LUA_YIELD) return;
+static void wheel_unlink(pulsar_wheel *w, pulsar_wheel_node *node) {
+	*node->pprev = node->next;
+	if (node->next) node->next->pprev = node->pprev;
+	if (!w->slots[node->level][node->slot]) w->bitmap[node->level][node->slot >> 6] &= ~((uint64_t)1 << (node->slot & 63));
+	w->nb[node->level]--;
+}
 
-	// Finished, end the idle
-	if (!ret) {
-		uv_idle_stop(idle->w_timeout);
-		idle->active = false;
-		return;
+// How many slots after the current one the next used slot of a level is, 0 if the level is empty
+static int wheel_level_next(pulsar_wheel *w, int level) {
+	if (!w->nb[level]) return 0;
+	int idx = (w->now >> (PULSAR_WHEEL_BITS * level)) & PULSAR_WHEEL_MASK;
+	int i = 0;
+	while (i < PULSAR_WHEEL_SLOTS) {
+		int slot = (idx + 1 + i) & PULSAR_WHEEL_MASK;
+		uint64_t word = w->bitmap[level][slot >> 6] >> (slot & 63);
+		if (word) return 1 + i + __builtin_ctzll(word);
+		i += 64 - (slot & 63);
 	}
+	return 0;
+}
 
-	if (ret == LUA_ERRRUN) {
-		printf("Error while running idle's coroutine: %s\n", lua_tostring(L, -1));
-		traceback(L);
+/*
+** Next tick where something happens: a first level slot firing or a slot of an upper level
+** moving down, nothing to do in between. Returns 0 when the wheel is empty.
+*/
+static uint64_t wheel_next(pulsar_wheel *w) {
+	uint64_t next = 0;
+	int level;
+	for (level = 0; level < PULSAR_WHEEL_LEVELS; level++) {
+		int k = wheel_level_next(w, level);
+		if (!k) continue;
+		int shift = PULSAR_WHEEL_BITS * level;
+		uint64_t at = ((w->now >> shift) + k) << shift;
+		if (!next || (at < next)) next = at;
+	}
+	return next;
+}
 
-		uv_idle_stop(idle->w_timeout);
-		idle->active = false;
+static void wheel_schedule(pulsar_wheel *w) {
+	uint64_t next = wheel_next(w);
+	if (!next) {
+		if (w->scheduled) uv_timer_stop(&w->timer);
+		w->scheduled = 0;
 		return;
 	}
+	if (next == w->scheduled) return;
+	w->scheduled = next;
+	uint64_t now = uv_now(w->timer.loop);
+	uv_timer_start(&w->timer, wheel_timer_cb, (next > now) ? next - now : 0, 0);
 }
 
-static void idle_cb(uv_idle_t *_watcher, int status) {
-	pulsar_idle *idle = (pulsar_idle *)_watcher->data;
+static void wheel_cascade(pulsar_wheel *w, int level) {
+	int slot = (w->now >> (PULSAR_WHEEL_BITS * level)) & PULSAR_WHEEL_MASK;
+	pulsar_wheel_node *node = w->slots[level][slot];
+	w->slots[level][slot] = NULL;
+	w->bitmap[level][slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+	while (node) {
+		pulsar_wheel_node *next = node->next;
+		w->nb[level]--;
+		wheel_link(w, node);
+		node = next;
+	}
+}
 
-	if (idle->first_run) {
-		idle->first_run = false;
-		pulsar_idle_resume(idle, idle->L, 1);
-	} else {
-		pulsar_idle_resume(idle, idle->L, 0);
+static void wheel_advance(pulsar_wheel *w, uint64_t target) {
+	while (w->now < target) {
+		uint64_t next = wheel_next(w);
+		if (!next || (next > target)) {
+			w->now = target;
+			break;
+		}
+		w->now = next;
+
+		// Move entries down from each level whose lower levels all wrapped around
+		if (!(w->now & PULSAR_WHEEL_MASK)) {
+			int level = 1;
+			while ((level < PULSAR_WHEEL_LEVELS - 1) && !((w->now >> (PULSAR_WHEEL_BITS * level)) & PULSAR_WHEEL_MASK)) level++;
+			for (; level >= 1; level--) wheel_cascade(w, level);
+		}
+
+		// Fire what is due, callbacks can add and remove nodes but never in this slot
+		pulsar_wheel_node **head = &w->slots[0][w->now & PULSAR_WHEEL_MASK];
+		while (*head) {
+			pulsar_wheel_node *node = *head;
+			wheel_unlink(w, node);
+			node->active = false;
+			node->cb(node);
+		}
 	}
 }
 
-static int pulsar_idle_close(lua_State *L) {
-	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
-	uv_idle_stop(idle->w_timeout);
-	uv_close((uv_handle_t*)idle->w_timeout, close_cb);
-	idle->active = false;
-	luaL_unref(L, LUA_REGISTRYINDEX, idle->co_ref);
-	return 0;
+static void wheel_timer_cb(uv_timer_t *handle, int status) {
+	pulsar_wheel *w = (pulsar_wheel*)handle->data;
+	w->scheduled = 0;
+	wheel_advance(w, uv_now(handle->loop));
+	wheel_schedule(w);
 }
-static int pulsar_idle_start(lua_State *L) {
-	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
-	uv_idle_start(idle->w_timeout, idle_cb);
-	idle->active = true;
-	return 0;
+
+/*
+** (Re)arm node to fire in ms milliseconds
+*/
+static void wheel_add(pulsar_wheel *w, pulsar_wheel_node *node, uint64_t ms) {
+	uint64_t now = uv_now(w->timer.loop);
+	if (node->active) wheel_unlink(w, node);
+	else if (wheel_empty(w) && (now > w->now)) w->now = now;
+
+	node->expires = now + ms;
+	if (node->expires <= w->now) node->expires = w->now + 1;
+	wheel_link(w, node);
+	node->active = true;
+	wheel_schedule(w);
 }
-static int pulsar_idle_stop(lua_State *L) {
-	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
-	uv_idle_stop(idle->w_timeout);
-	idle->active = false;
-	return 0;
+
+static void wheel_remove(pulsar_wheel *w, pulsar_wheel_node *node) {
+	if (!node->active) return;
+	wheel_unlink(w, node);
+	node->active = false;
+	wheel_schedule(w);
 }
-static int pulsar_idle_next(lua_State *L) {
-	return lua_yield(L, 0);
+
+static void wheel_node_init(pulsar_wheel_node *node, pulsar_wheel_cb cb, void *data) {
+	node->active = false;
+	node->cb = cb;
+	node->data = data;
 }
 
-static int pulsar_idle_new(lua_State *L)
+static void sleep_cb(pulsar_wheel_node *node) {
+	pulsar_sleep *sl = (pulsar_sleep*)node->data;
+	pulsar_loop *loop = sl->loop;
+	lua_State *L = sl->L;
+	int L_ref = sl->L_ref;
+	pulsar_owner owner = sl->owner;
+	free(sl);
+
+	owner_wakeup(loop, &owner, L, 0);
+	luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+}
+
+static int pulsar_loop_sleep(lua_State *L)
 {
 	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
-	if (!lua_isfunction(L, 2)) { lua_pushstring(L, "argument 1 is not a function"); lua_error(L); return 0; }
+	double seconds = luaL_checknumber(L, 2);
+	if (lua_pushthread(L)) { lua_pushstring(L, "sleep must be called from a coroutine"); lua_error(L); return 0; }
+
+	pulsar_sleep *sl = (pulsar_sleep*)malloc(sizeof(pulsar_sleep));
+	wheel_node_init(&sl->node, sleep_cb, sl);
+	sl->loop = loop;
+	sl->L = L;
+	sl->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	sl->owner = loop_owner(loop, L);
+	wheel_add(&loop->wheel, &sl->node, wheel_ms(seconds));
+	return lua_yield(L, 0);
+}
 
-	// Initialize and start a watcher to accepts client requests
-	pulsar_idle *idle = (pulsar_idle*)lua_newuserdata(L, sizeof(pulsar_idle));
-	pulsar_setmeta(L, MT_PULSAR_IDLE);
-	idle->loop = loop;
-	idle->active = false;
-	idle->first_run = true;
+/**************************************************************************************
+ ** Addresses
+ **************************************************************************************/
+// Numeric IPv4 or IPv6 address, returns 0 if host is one
+static int addr_parse(const char *host, int port, struct sockaddr_storage *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if (!uv_ip4_addr(host, port, (struct sockaddr_in*)addr)) return 0;
+	if (!uv_ip6_addr(host, port, (struct sockaddr_in6*)addr)) return 0;
+	return -1;
+}
 
-	idle->L = lua_newthread(L);
-	lua_atpanic(idle->L, pulsar_panic);
-	lua_pushvalue(L, 2);
-	lua_pushvalue(L, 3);
-	lua_xmove(L, idle->L, 2);
+static void addr_set_port(struct sockaddr_storage *addr, int port) {
+	if (addr->ss_family == AF_INET6) ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+	else ((struct sockaddr_in*)addr)->sin_port = htons(port);
+}
 
-	idle->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+// Pushes the host string and the port
+static void push_sockaddr(lua_State *L, const struct sockaddr *addr) {
+	char name[INET6_ADDRSTRLEN];
+	if (addr->sa_family == AF_INET6) {
+		uv_ip6_name((const struct sockaddr_in6*)addr, name, sizeof(name));
+		lua_pushstring(L, name);
+		lua_pushnumber(L, ntohs(((const struct sockaddr_in6*)addr)->sin6_port));
+	} else {
+		uv_ip4_name((const struct sockaddr_in*)addr, name, sizeof(name));
+		lua_pushstring(L, name);
+		lua_pushnumber(L, ntohs(((const struct sockaddr_in*)addr)->sin_port));
+	}
+}
 
-	idle->w_timeout = (uv_idle_t*)malloc(sizeof(uv_idle_t));
-	idle->w_timeout->data = idle;
-	uv_idle_init(loop->loop, idle->w_timeout);
-	return 1;
+/*
+** Resolved names are cached per loop for the cache's TTL, getaddrinfo does not tell the
+** records' own TTLs
+*/
+static unsigned int dns_hash(const char *host) {
+	unsigned int h = 5381;
+	while (*host) h = h * 33 + (unsigned char)*host++;
+	return h & (PULSAR_DNS_BUCKETS - 1);
 }
 
-/**************************************************************************************
- ** Idle Workers
- **************************************************************************************/
-static void pulsar_idle_worker_resume(pulsar_idle_worker *idle_worker, lua_State *L, int nargs) {
-	int ret = lua_resume(L, nargs);
-	// More to do
-	if (ret == LUA_YIELD) return;
+static void dns_init(pulsar_dns_cache *dns) {
+	memset(dns, 0, sizeof(pulsar_dns_cache));
+	dns->max = PULSAR_DNS_MAX;
+	dns->ttl = PULSAR_DNS_TTL * 1000;
+}
 
-	// Finished, end the idle_worker
-	if (!ret) {
-		uv_idle_stop(idle_worker->w_timeout);
-		idle_worker->active = false;
-		return;
+static void dns_entry_free(pulsar_dns_entry *e) {
+	free(e->host);
+	free(e->addrs);
+	free(e);
+}
+
+// Drops expired entries, or all of them when now is 0
+static void dns_purge(pulsar_dns_cache *dns, uint64_t now) {
+	int i;
+	if (!dns->buckets) return;
+	for (i = 0; i < PULSAR_DNS_BUCKETS; i++) {
+		pulsar_dns_entry **prev = &dns->buckets[i];
+		while (*prev) {
+			pulsar_dns_entry *e = *prev;
+			if (!now || (e->expires <= now)) {
+				*prev = e->next;
+				dns_entry_free(e);
+				dns->nb--;
+			}
+			else prev = &e->next;
+		}
 	}
+}
 
-	if (ret == LUA_ERRRUN) {
-		printf("Error while running idle_worker's coroutine: %s\n", lua_tostring(L, -1));
-		traceback(L);
+static void dns_free(pulsar_dns_cache *dns) {
+	dns_purge(dns, 0);
+	free(dns->buckets);
+	dns->buckets = NULL;
+}
 
-		uv_idle_stop(idle_worker->w_timeout);
-		idle_worker->active = false;
-		return;
+/*
+** Fills a malloced copy of the addresses for a numeric or cached host, returns -1 if
+** it has to be resolved
+*/
+static int dns_lookup(pulsar_loop *loop, const char *host, struct sockaddr_storage **addrs, int *nb) {
+	pulsar_dns_cache *dns = &loop->dns;
+	struct sockaddr_storage addr;
+	if (!addr_parse(host, 0, &addr)) {
+		*addrs = malloc(sizeof(struct sockaddr_storage));
+		**addrs = addr;
+		*nb = 1;
+		return 0;
+	}
+	if (!dns->buckets) { dns->misses++; return -1; }
+
+	uint64_t now = uv_now(loop->loop);
+	pulsar_dns_entry **prev = &dns->buckets[dns_hash(host)];
+	while (*prev) {
+		pulsar_dns_entry *e = *prev;
+		if (!strcmp(e->host, host)) {
+			if (e->expires <= now) {
+				*prev = e->next;
+				dns_entry_free(e);
+				dns->nb--;
+				break;
+			}
+			*addrs = malloc(e->nb * sizeof(struct sockaddr_storage));
+			memcpy(*addrs, e->addrs, e->nb * sizeof(struct sockaddr_storage));
+			*nb = e->nb;
+			dns->hits++;
+			return 0;
+		}
+		prev = &e->next;
 	}
+	dns->misses++;
+	return -1;
 }
 
-static void idle_worker_cb(uv_idle_t *_watcher, int status) {
-	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)_watcher->data;
-	if (!idle_worker->chain) {
-		uv_idle_stop(idle_worker->w_timeout);
-		idle_worker->active = false;
-		return;
+static void dns_store(pulsar_loop *loop, const char *host, struct sockaddr_storage *addrs, int nb) {
+	pulsar_dns_cache *dns = &loop->dns;
+	if (!dns->ttl || !dns->max) return;
+	uint64_t now = uv_now(loop->loop);
+	if (dns->nb >= dns->max) dns_purge(dns, now);
+	if (dns->nb >= dns->max) return;
+	if (!dns->buckets) dns->buckets = calloc(PULSAR_DNS_BUCKETS, sizeof(pulsar_dns_entry*));
+
+	pulsar_dns_entry *e = malloc(sizeof(pulsar_dns_entry));
+	e->host = strdup(host);
+	e->addrs = malloc(nb * sizeof(struct sockaddr_storage));
+	memcpy(e->addrs, addrs, nb * sizeof(struct sockaddr_storage));
+	e->nb = nb;
+	e->expires = now + dns->ttl;
+	unsigned int h = dns_hash(host);
+	e->next = dns->buckets[h];
+	dns->buckets[h] = e;
+	dns->nb++;
+}
+
+static void dns_resolve_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+	pulsar_resolve *resolve = (pulsar_resolve*)req->data;
+	struct sockaddr_storage *addrs = NULL;
+	int nb = 0;
+	if (!status) {
+		struct addrinfo *ai;
+		for (ai = res; ai; ai = ai->ai_next) if ((ai->ai_family == AF_INET) || (ai->ai_family == AF_INET6)) nb++;
+		if (nb) {
+			addrs = calloc(nb, sizeof(struct sockaddr_storage));
+			nb = 0;
+			for (ai = res; ai; ai = ai->ai_next) {
+				if ((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6)) continue;
+				memcpy(&addrs[nb++], ai->ai_addr, ai->ai_addrlen);
+			}
+			dns_store(resolve->loop, resolve->host, addrs, nb);
+		}
+		else status = -1;
 	}
+	if (res) uv_freeaddrinfo(res);
+	if (status) resolve->loop->dns.failures++;
 
-	pulsar_idle_worker_chain *chain = idle_worker->chain;
-	idle_worker->chain = idle_worker->chain->next;
-	lua_State *rL = chain->L;
-	luaL_unref(rL, LUA_REGISTRYINDEX, chain->L_ref);
-	int nargs = chain->nargs;
-	free(chain);
+	resolve->cb(resolve->data, status, addrs, nb);
+	free(resolve->host);
+	free(resolve);
+}
 
-	pulsar_idle_worker_resume(idle_worker, rL, nargs);
+// The callback gets a malloced list of addresses it has to free
+static pulsar_resolve *dns_resolve(pulsar_loop *loop, const char *host, pulsar_resolve_cb cb, void *data) {
+	pulsar_resolve *resolve = (pulsar_resolve*)malloc(sizeof(pulsar_resolve));
+	resolve->loop = loop;
+	resolve->host = strdup(host);
+	resolve->cb = cb;
+	resolve->data = data;
+	resolve->req.data = resolve;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (uv_getaddrinfo(loop->loop, &resolve->req, dns_resolve_cb, host, NULL, &hints)) {
+		free(resolve->host);
+		free(resolve);
+		return NULL;
+	}
+	return resolve;
 }
 
-static int pulsar_idle_worker_close(lua_State *L) {
-	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)luaL_checkudata (L, 1, MT_PULSAR_IDLE_WORKER);
-	uv_idle_stop(idle_worker->w_timeout);
-	idle_worker->active = false;
-	while (idle_worker->chain) {
-		pulsar_idle_worker_chain *chain = idle_worker->chain;
-		idle_worker->chain = idle_worker->chain->next;
+// Pushes the list of the addresses as strings
+static void push_addrs(lua_State *L, struct sockaddr_storage *addrs, int nb) {
+	int i;
+	lua_createtable(L, nb, 0);
+	for (i = 0; i < nb; i++) {
+		push_sockaddr(L, (const struct sockaddr*)&addrs[i]);
+		lua_pop(L, 1);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+static void resolve_wait_cb(void *data, int status, struct sockaddr_storage *addrs, int nb) {
+	pulsar_resolve_wait *wait = (pulsar_resolve_wait*)data;
+	lua_State *L = wait->L;
+	int L_ref = wait->L_ref;
+	pulsar_loop *loop = wait->loop;
+	pulsar_owner owner = wait->owner;
+	free(wait);
+
+	if (status) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not resolve");
+		owner_wakeup(loop, &owner, L, 2);
+	} else {
+		push_addrs(L, addrs, nb);
+		owner_wakeup(loop, &owner, L, 1);
+	}
+	free(addrs);
+	luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+}
+
+static int pulsar_loop_resolve(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *host = luaL_checkstring(L, 2);
+	struct sockaddr_storage *addrs;
+	int nb;
+	if (!dns_lookup(loop, host, &addrs, &nb)) {
+		push_addrs(L, addrs, nb);
+		free(addrs);
+		return 1;
+	}
+	if (lua_pushthread(L)) { lua_pushstring(L, "resolve must be called from a coroutine"); lua_error(L); return 0; }
+
+	pulsar_resolve_wait *wait = (pulsar_resolve_wait*)malloc(sizeof(pulsar_resolve_wait));
+	wait->loop = loop;
+	wait->L = L;
+	wait->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	wait->owner = loop_owner(loop, L);
+	if (!dns_resolve(loop, host, resolve_wait_cb, wait)) {
+		luaL_unref(L, LUA_REGISTRYINDEX, wait->L_ref);
+		free(wait);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not resolve");
+		return 2;
+	}
+	return lua_yield(L, 0);
+}
+
+static int pulsar_loop_dns_cache(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_dns_cache *dns = &loop->dns;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "ttl");
+		if (lua_isnumber(L, -1)) dns->ttl = wheel_ms(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "max");
+		if (lua_isnumber(L, -1)) dns->max = (lua_tonumber(L, -1) > 0) ? lua_tonumber(L, -1) : 0;
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "flush");
+		if (lua_toboolean(L, -1)) dns_purge(dns, 0);
+		lua_pop(L, 1);
+	}
+
+	lua_newtable(L);
+	lua_pushnumber(L, dns->nb); lua_setfield(L, -2, "size");
+	lua_pushnumber(L, dns->max); lua_setfield(L, -2, "max");
+	lua_pushnumber(L, dns->ttl / 1000.0); lua_setfield(L, -2, "ttl");
+	lua_pushnumber(L, dns->hits); lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, dns->misses); lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, dns->failures); lua_setfield(L, -2, "failures");
+	return 1;
+}
+
+/**************************************************************************************
+ ** TCP Client calls
+ **************************************************************************************/
+static void pulsar_client_resume(pulsar_tcp_client *client, lua_State *L, int nargs);
+
+static void close_cb(uv_handle_t* handle) {
+	free((void*)handle);
+}
+
+// Forget about the buffer a read was going to fill
+static void client_release_read_target(pulsar_tcp_client *client, lua_State *L) {
+	if (!client->read_target) return;
+	client->read_target->pins--;
+	client->read_target = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, client->read_target_ref);
+	client->read_target_ref = LUA_NOREF;
+}
+
+/*
+** Hand read data to the coroutine, as a string or appended to the buffer the read was given
+*/
+static void client_push_read(pulsar_tcp_client *client, lua_State *L, const char *data, size_t len) {
+	pulsar_buffer *target = client->read_target;
+	if (!target) {
+		lua_pushlstring(L, data, len);
+		return;
+	}
+	buffer_append(target, data, len);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, client->read_target_ref);
+	client_release_read_target(client, L);
+}
+
+// Reads given a buffer as last argument fill it instead of making a string
+static void client_set_read_target(pulsar_tcp_client *client, lua_State *L, int idx) {
+	pulsar_buffer *target = pulsar_tobuffer(L, idx);
+	if (!target) return;
+	if (target->pins) { lua_pushstring(L, "buffer is in use by a read or a send"); lua_error(L); }
+	target->pins++;
+	client->read_target = target;
+	lua_pushvalue(L, idx);
+	client->read_target_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Forget about the pending read, it will not complete
+static void client_read_wait_clear(pulsar_tcp_client *client, lua_State *L) {
+	client->read_wait_len = 0;
+	client->read_direct = false;
+	if (client->read_wait_until) free(client->read_wait_until);
+	if (client->read_wait_ignorelen) free(client->read_wait_ignore);
+	client->read_wait_until = NULL;
+	client->read_wait_ignore = NULL;
+	client->read_wait_ignorelen = 0;
+	client_release_read_target(client, L);
+	wheel_remove(&client->loop->wheel, &client->read_node);
+}
+
+static void splice_end(pulsar_splice *s, const char *reason);
+static void conn_pool_detach(pulsar_tcp_client *client);
+
+static void client_close(pulsar_tcp_client *client) {
+	if (client->closed) return;
+	client->closed = true;
+	const char *reason = client->close_reason ? client->close_reason : "disconnected";
+	wheel_remove(&client->loop->wheel, &client->write_node);
+	if (client->pool) conn_pool_detach(client);
+	if (client->splice_out) splice_end(client->splice_out, reason);
+	if (client->splice_in) splice_end(client->splice_in, reason);
+
+	// Resume waiting coroutines so that they can fail
+	if (client->read_wait_len) {
+		lua_State *rL = client->rL;
+		int rL_ref = client->rL_ref;
+		client_read_wait_clear(client, rL);
+		if (lua_status(rL) == LUA_YIELD) {
+			lua_pushnil(rL);
+			lua_pushstring(rL, reason);
+			pulsar_client_resume(client, rL, 2);
+			luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+		}
+	}
+	if (client->wL) {
+		lua_State *wL = client->wL;
+		int wL_ref = client->wL_ref;
+		client->wL = NULL;
+		lua_pushnil(wL);
+		lua_pushstring(wL, reason);
+		pulsar_client_resume(client, wL, 2);
+		luaL_unref(wL, LUA_REGISTRYINDEX, wL_ref);
+	}
+
+	client->read_direct = false;
+	if (client->active) uv_read_stop((uv_stream_t*)client->sock);
+	client->active = false;
+	client->disconnected = true;
+	// A file being sent stops once its read or write in progress is done
+	if (client->sendfile) client->sendfile_cancel = true;
+	uv_close((uv_handle_t*)client->sock, close_cb);
+	if (!client->standalone && client->loop->cluster) client->loop->cluster->clients--;
+	client->loop->metrics.clients--;
+
+	read_buffer_free(&client->loop->pool, &client->read_buf);
+}
+
+static void client_resume_now(pulsar_tcp_client *client, lua_State *L, int nargs) {
+	client->sched_reads = 0;
+	int ret = loop_resume(client->loop, PULSAR_RESUME_CLIENT, client, L, nargs);
+	// More to do
+	if (ret == LUA_YIELD) return;
+	if (client->standalone) return;
+
+	// The client's own coroutine ended, it can run another client
+	if (!ret) {
+		if (L == client->co) {
+			pulsar_co_release(client->loop, L, client->co_ref);
+			client->co = NULL;
+			client->co_ref = LUA_NOREF;
+		}
+		return;
+	}
+
+	// Finished, end the client
+/*	if (!ret) {
+		printf("Closing at resume %lx\n", client);
+		client_close(client);
+		// Let the rest free up by GC
+		return;
+	}
+*/
+	if (ret == LUA_ERRRUN) {
+		printf("Error while running client's coroutine (fd): %s\n", lua_tostring(L, -1));
+		stackDump(L);
+		traceback(L);
+		printf("Closing at error %lx\n", client);
+		if (L == client->co) {
+			luaL_unref(L, LUA_REGISTRYINDEX, client->co_ref);
+			client->co = NULL;
+			client->co_ref = LUA_NOREF;
+		}
+		client_close(client);
+		// Let the rest free up by GC
+		return;
+	}
+}
+
+static void client_task_cb(void *data, lua_State *L, int nargs) {
+	client_resume_now((pulsar_tcp_client *)data, L, nargs);
+}
+
+static void pulsar_client_resume(pulsar_tcp_client *client, lua_State *L, int nargs) {
+	sched_wakeup(client->loop, client->priority, client_task_cb, client, L, nargs);
+}
+
+/*
+** A connection that always has data at hand gives way to the others every quantum reads,
+** the nret results stay on the stack and are returned once the scheduler resumes it
+*/
+static int client_read_done(pulsar_tcp_client *client, lua_State *L, int nret) {
+	pulsar_scheduler *sched = &client->loop->sched;
+	if (!sched->enabled || (++client->sched_reads < sched->quantum)) return nret;
+	client->sched_reads = 0;
+	sched_wakeup(client->loop, client->priority, client_task_cb, client, L, nret);
+	return lua_yield(L, nret);
+}
+
+static int pulsar_tcp_client_close(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	client_close(client);
+	return 0;
+}
+
+static int pulsar_tcp_client_is_connected(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	lua_pushboolean(L, !client->closed && client->active && !client->disconnected);
+	return 1;
+}
+static int pulsar_tcp_client_has_data(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	lua_pushboolean(L, !client->closed && read_buffer_size(&client->read_buf) > 0);
+	return 1;
+}
+
+static int pulsar_tcp_client_write_queue_size(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	lua_pushnumber(L, client->closed ? 0 : client->sock->write_queue_size);
+	return 1;
+}
+
+static int pulsar_tcp_client_set_water_marks(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	int high = luaL_checknumber(L, 2);
+	int low = luaL_optnumber(L, 3, high / 2);
+	if ((high < 0) || (low < 0) || (low > high)) { lua_pushstring(L, "invalid water marks"); lua_error(L); return 0; }
+	client->write_high = high;
+	client->write_low = low;
+	return 0;
+}
+
+/*
+** Park the coroutine until the write queue goes down to the given size
+*/
+/*
+** While a coroutine waits on writes the queue must make progress within the write timeout
+*/
+static void client_write_timer_update(pulsar_tcp_client *client) {
+	if (client->write_timeout && !client->closed && (client->write_blocked || client->wL))
+		wheel_add(&client->loop->wheel, &client->write_node, client->write_timeout);
+	else
+		wheel_remove(&client->loop->wheel, &client->write_node);
+}
+
+// Queued data can not be taken back, the connection is of no use anymore
+static void client_write_timeout_cb(pulsar_wheel_node *node) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)node->data;
+	client->close_reason = "timeout";
+	client_close(client);
+}
+
+static int client_write_wait(pulsar_tcp_client *client, lua_State *L, size_t size, bool drain) {
+	lua_pushthread(L); client->wL = lua_tothread(L, -1); client->wL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	client->write_wait = size;
+	client->write_wait_drain = drain;
+	client_write_timer_update(client);
+	return lua_yield(L, 0);
+}
+
+/*
+** Wake up the coroutine waiting for the write queue to go down, if it has
+*/
+static void client_write_resume(pulsar_tcp_client *client) {
+	if (!client->wL || client->closed) return;
+	if (client->sock->write_queue_size > client->write_wait) return;
+
+	lua_State *wL = client->wL;
+	int wL_ref = client->wL_ref;
+	client->wL = NULL;
+	if (client->write_wait_drain) {
+		lua_pushboolean(wL, 1);
+		pulsar_client_resume(client, wL, 1);
+	} else {
+		pulsar_client_resume(client, wL, 0);
+	}
+	luaL_unref(wL, LUA_REGISTRYINDEX, wL_ref);
+}
+
+static int pulsar_tcp_client_drain(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (client->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "disconnected");
+		return 2;
+	}
+	if (!client->sock->write_queue_size) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if (client->wL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "already waiting on writes");
+		return 2;
+	}
+	return client_write_wait(client, L, 0, true);
+}
+
+static void tcp_client_send_cb(uv_write_t *_req, int status){
+	pulsar_tcp_client_send_chain *req = (pulsar_tcp_client_send_chain*)_req;
+	pulsar_tcp_client *client = req->client;
+	pulsar_metrics *metrics = &client->loop->metrics;
+	metrics->writes_pending--;
+	metrics->write_bytes_pending -= req->buf.len;
+	if (!status) metrics->bytes_written += req->buf.len;
+
+	//free(req->buf.base);
+	if (req->buffer) req->buffer->pins--;
+	if (!req->nowait) {
+		client->write_blocked--;
+		if (status) {
+			lua_pushnil(req->sL);
+			lua_pushstring(req->sL, client->close_reason ? client->close_reason : "write failed");
+			pulsar_client_resume(client, req->sL, 2);
+		} else {
+			lua_pushnumber(req->sL, req->total);
+			pulsar_client_resume(client, req->sL, 1);
+		}
+	}
+	client_write_resume(client);
+	client_write_timer_update(client);
+
+	luaL_unref(req->sL, LUA_REGISTRYINDEX, req->data_ref);
+	luaL_unref(req->sL, LUA_REGISTRYINDEX, req->client_ref);
+	luaL_unref(req->sL, LUA_REGISTRYINDEX, req->sL_ref);
+
+	free(req);
+}
+
+static int pulsar_tcp_client_send(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (client->closed) return 0;
+	if (client->sendfile) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "sendfile in progress");
+		return 2;
+	}
+	size_t datalen;
+	const char *data;
+	pulsar_buffer *buffer = pulsar_tobuffer(L, 2);
+	if (buffer) {
+		data = buffer->data;
+		datalen = buffer->len;
+	}
+	else data = lua_tolstring(L, 2, &datalen);
+	bool nowait = lua_toboolean(L, 3);
+
+	// Most of the time the socket has room for it all, no need to queue and wait then
+	size_t written = 0;
+	if (!client->sock->write_queue_size) {
+		uv_buf_t buf = uv_buf_init((char*)data, datalen);
+		int ret = uv_try_write((uv_stream_t*)client->sock, &buf, 1);
+		if (ret > 0) written = ret;
+	}
+	client->loop->metrics.bytes_written += written;
+	if (written == datalen) {
+		if (nowait) return 0;
+		lua_pushnumber(L, datalen);
+		return 1;
+	}
+
+	// Queue whatever is left
+	pulsar_tcp_client_send_chain *req = (pulsar_tcp_client_send_chain*)malloc(sizeof(pulsar_tcp_client_send_chain));
+	req->client = client;
+	req->buf.len = datalen - written;
+	req->buf.base = (char*)data + written;
+	req->total = datalen;
+	// The buffer's memory is written from directly, it must not change until then
+	req->buffer = buffer;
+	if (buffer) buffer->pins++;
+
+	uv_write((uv_write_t*)req, (uv_stream_t*)client->sock, &req->buf, 1, tcp_client_send_cb);
+	client->loop->metrics.writes_pending++;
+	client->loop->metrics.write_bytes_pending += req->buf.len;
+
+	lua_pushthread(L); req->sL = lua_tothread(L, -1); req->sL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	req->nowait = nowait;
+
+	lua_pushvalue(L, 2);
+	req->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 1);
+	req->client_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if (nowait) {
+		// Too much is queued, wait for the peer to catch up
+		if (client->write_high && (client->sock->write_queue_size >= client->write_high) && !client->wL)
+			return client_write_wait(client, L, client->write_low, false);
+		return 0;
+	}
+	else {
+		client->write_blocked++;
+		client_write_timer_update(client);
+		return lua_yield(L, 0);
+	}
+	return 0;
+}
+
+/*
+** Find until in data starting at offset from, returns the position or -1
+** The first byte is located with memchr (vectorized by the libc) and the rest verified
+*/
+static ssize_t buffer_find(const char *data, size_t avail, size_t from, const char *until, size_t len) {
+	if (len > avail) return -1;
+	const char *p = data + from;
+	const char *last = data + avail - len;
+	while (p <= last) {
+		p = memchr(p, until[0], last - p + 1);
+		if (!p) return -1;
+		if (!memcmp(p + 1, until + 1, len - 1)) return p - data;
+		p++;
+	}
+	return -1;
+}
+
+static ssize_t client_find_until(pulsar_tcp_client *client, const char *until, size_t len, size_t from) {
+	return buffer_find(read_buffer_data(&client->read_buf), read_buffer_size(&client->read_buf), from, until, len);
+}
+
+/*
+** Push the data up to pos, minus the ignore string if it is there, and consume it along with the until string
+*/
+static void client_push_until(pulsar_tcp_client *client, lua_State *L, size_t pos, size_t len, const char *ignore, size_t ignorelen) {
+	const char *data = read_buffer_data(&client->read_buf);
+	if (ignorelen && (ignorelen <= pos) && !memcmp(data + pos - ignorelen, ignore, ignorelen))
+		client_push_read(client, L, data, pos - ignorelen);
+	else
+		client_push_read(client, L, data, pos);
+	read_buffer_consume(&client->read_buf, pos + len);
+}
+
+/*
+** Wake up the coroutine waiting on a read if the buffered data is enough to satisfy it
+*/
+static void client_read_resume(pulsar_tcp_client *client) {
+	// Reading straight into the target buffer
+	if (client->read_direct) {
+		if (client->read_wait_len) return;
+		lua_State *rL = client->rL;
+		int rL_ref = client->rL_ref;
+		client->read_direct = false;
+		wheel_remove(&client->loop->wheel, &client->read_node);
+		lua_rawgeti(rL, LUA_REGISTRYINDEX, client->read_target_ref);
+		client_release_read_target(client, rL);
+
+		pulsar_client_resume(client, rL, 1);
+		luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+		return;
+	}
+
+	size_t avail = read_buffer_size(&client->read_buf);
+	if (!avail) return;
+
+	if ((client->read_wait_len > 0) && (client->read_wait_len != WAIT_LEN_UNTIL) && (avail >= client->read_wait_len)) {
+		lua_State *rL = client->rL;
+		int rL_ref = client->rL_ref;
+		client_push_read(client, rL, read_buffer_data(&client->read_buf), client->read_wait_len);
+		read_buffer_consume(&client->read_buf, client->read_wait_len);
+		client->read_wait_len = 0;
+		wheel_remove(&client->loop->wheel, &client->read_node);
+
+		pulsar_client_resume(client, rL, 1);
+		luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+		return;
+	}
+
+	if (client->read_wait_len == WAIT_LEN_UNTIL) {
+		size_t len = client->read_wait_untillen;
+		ssize_t pos = client_find_until(client, client->read_wait_until, len, client->read_wait_scanned);
+		if (pos < 0) {
+			// Next time only look at the new data, and the tail that could start a match
+			if (avail >= len) client->read_wait_scanned = avail - len + 1;
+			return;
+		}
+
+		lua_State *rL = client->rL;
+		int rL_ref = client->rL_ref;
+		client_push_until(client, rL, pos, len, client->read_wait_ignore, client->read_wait_ignorelen);
+		client_read_wait_clear(client, rL);
+
+		pulsar_client_resume(client, rL, 1);
+		luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+		return;
+	}
+}
+
+static void client_read_timeout_cb(pulsar_wheel_node *node) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)node->data;
+	if (!client->read_wait_len) return;
+	lua_State *rL = client->rL;
+	int rL_ref = client->rL_ref;
+	client_read_wait_clear(client, rL);
+
+	lua_pushnil(rL);
+	lua_pushliteral(rL, "timeout");
+	pulsar_client_resume(client, rL, 2);
+	luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+}
+
+static int client_read_wait(pulsar_tcp_client *client, lua_State *L) {
+	if (client->read_timeout) wheel_add(&client->loop->wheel, &client->read_node, client->read_timeout);
+	return lua_yield(L, 0);
+}
+
+/*
+** Data is read straight into the client's receive buffer, reserving the loop's read size
+*/
+static void tcp_client_buf_alloc(uv_handle_t* handle, size_t size, uv_buf_t *b) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)handle->data;
+	if (client->read_direct) {
+		// Never more than asked so the rest stays for the next read
+		b->base = buffer_reserve(client->read_target, client->read_wait_len);
+		b->len = client->read_wait_len;
+		return;
+	}
+	// A pending read(n) only needs the rest of n, asking for more would grow the buffer again
+	pulsar_read_buffer *rb = &client->read_buf;
+	size_t want = client->loop->read_size;
+	if (client->read_wait_len && (client->read_wait_len != WAIT_LEN_UNTIL)) {
+		size_t avail = read_buffer_size(rb);
+		want = (client->read_wait_len > avail) ? client->read_wait_len - avail : 0;
+		if (want < MIN_READ_SIZE) want = MIN_READ_SIZE;
+	}
+	b->base = read_buffer_reserve(&client->loop->pool, rb, want);
+	b->len = rb->buflen - rb->wpos;
+}
+
+static bool splice_forward(pulsar_splice *s);
+
+static void tcp_client_read_cb(uv_stream_t *watcher, ssize_t read, const uv_buf_t *buf){
+	pulsar_tcp_client *client = (pulsar_tcp_client *)watcher->data;
+	if (client->closed) return;
+
+	if (read < 0)
+	{
+		client_close(client);
+		return;
+	}
+	if (read > 0) {
+		client->loop->metrics.bytes_read += read;
+		if (client->read_direct) {
+			client->read_target->len += read;
+			client->read_wait_len -= read;
+		}
+		else read_buffer_commit(&client->read_buf, read);
+		if (client->splice_out) {
+			pulsar_splice *s = client->splice_out;
+			if (!splice_forward(s)) client_close(s->dst);
+		}
+		else client_read_resume(client);
+		if (client->closed) return;
+	}
+
+	read_buffer_trim(&client->loop->pool, &client->read_buf);
+}
+
+static int pulsar_tcp_client_read(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (!client->active || client->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "client read not active");
+		return 2;
+	}
+	if (client->splice_out) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "client is piped");
+		return 2;
+	}
+
+	int len = luaL_checknumber(L, 2);
+	client_set_read_target(client, L, 3);
+	if (len == 0) {
+		client_push_read(client, L, "", 0);
+		return 1;
+	}
+
+	// No need to wait, we already have enough data
+	size_t avail = read_buffer_size(&client->read_buf);
+	if (len <= avail) {
+		client_push_read(client, L, read_buffer_data(&client->read_buf), len);
+		read_buffer_consume(&client->read_buf, len);
+		return client_read_done(client, L, 1);
+	}
+
+	lua_pushthread(L); client->rL = lua_tothread(L, -1); client->rL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (client->read_target) {
+		// Move what we have and let the socket fill the buffer with the rest
+		buffer_append(client->read_target, read_buffer_data(&client->read_buf), avail);
+		read_buffer_consume(&client->read_buf, avail);
+		read_buffer_trim(&client->loop->pool, &client->read_buf);
+		buffer_reserve(client->read_target, len - avail);
+		client->read_direct = true;
+		client->read_wait_len = len - avail;
+	} else {
+		// Reserve the whole size once instead of growing on each incomming chunk
+		read_buffer_reserve(&client->loop->pool, &client->read_buf, len - avail);
+		client->read_wait_len = len;
+	}
+	return client_read_wait(client, L);
+}
+
+static int pulsar_tcp_client_read_until(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (!client->active || client->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "client read not active");
+		return 2;
+	}
+	if (client->splice_out) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "client is piped");
+		return 2;
+	}
+
+	size_t len;
+	const char *until = luaL_checklstring(L, 2, &len);
+	if (len < 1) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "empty until");
+		return 2;
+	}
+	size_t ignorelen = 0;
+	const char *ignore = NULL;
+	if (lua_isstring(L, 3)) ignore = lua_tolstring(L, 3, &ignorelen);
+	client_set_read_target(client, L, lua_gettop(L));
+
+	// No need to wait, we may have enough data
+	ssize_t pos = client_find_until(client, until, len, 0);
+	if (pos >= 0) {
+		client_push_until(client, L, pos, len, ignore, ignorelen);
+		return client_read_done(client, L, 1);
+	}
+
+	lua_pushthread(L); client->rL = lua_tothread(L, -1); client->rL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	client->read_wait_len = WAIT_LEN_UNTIL;
+	client->read_wait_until = malloc(len * sizeof(char));
+	memcpy(client->read_wait_until, until, len);
+	client->read_wait_untillen = len;
+	size_t avail = read_buffer_size(&client->read_buf);
+	client->read_wait_scanned = (avail >= len) ? avail - len + 1 : 0;
+	client->read_wait_ignorelen = ignorelen;
+	if (ignorelen) {
+		client->read_wait_ignore = malloc(ignorelen * sizeof(char));
+		memcpy(client->read_wait_ignore, ignore, ignorelen);
+	}
+	return client_read_wait(client, L);
+}
+
+static int pulsar_tcp_client_start(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (client->closed) return 0;
+	uv_read_start((uv_stream_t*)client->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+	client->active = true;
+	return 0;
+}
+static int pulsar_tcp_client_stop(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (client->closed) return 0;
+	uv_read_stop((uv_stream_t*)client->sock);
+	client->active = false;
+	return 0;
+}
+
+static int pulsar_tcp_client_getpeername(lua_State *L)
+{
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	if (client->closed) return 0;
+	if (client->pipe) {
+#if defined(UV_VERSION_HEX) && (UV_VERSION_HEX >= 0x010300)
+		char path[1024];
+		size_t pathlen = sizeof(path);
+		if (!uv_pipe_getpeername((uv_pipe_t*)client->sock, path, &pathlen)) {
+			lua_pushlstring(L, path, pathlen);
+			return 1;
+		}
+#endif
+		lua_pushnil(L);
+		lua_pushstring(L, "getpeername failed");
+		return 2;
+	}
+	struct sockaddr_storage peer;
+	int peerlen = sizeof(peer);
+	if (uv_tcp_getpeername((uv_tcp_t*)client->sock, (struct sockaddr*)&peer, &peerlen)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "getpeername failed");
+	} else {
+		push_sockaddr(L, (const struct sockaddr*)&peer);
+	}
+	return 2;
+}
+
+/*
+** pipeTo: what src reads is written to dst straight from the read buffer. Whatever the
+** socket does not take right away is queued by handing it the read buffer's slab, the
+** next read then gets a new one from the pool, so the data is never copied
+*/
+static void splice_write_cb(uv_write_t *_req, int status) {
+	pulsar_splice_write *req = (pulsar_splice_write*)_req;
+	pulsar_splice *s = req->splice;
+	size_t len = req->len;
+	pulsar_metrics *metrics = &s->loop->metrics;
+	metrics->writes_pending--;
+	metrics->write_bytes_pending -= len;
+	if (!status) metrics->bytes_written += len;
+	buffer_pool_put(&s->loop->pool, req->buf, req->size);
+	free(req);
+	s->writes--;
+
+	if (s->done) {
+		if (!s->writes) free(s);
+		return;
+	}
+	if (status) {
+		client_close(s->dst);
+		return;
+	}
+	s->bytes += len;
+
+	// The destination caught up, read again
+	if (s->paused && (s->dst->sock->write_queue_size <= s->bufsize / 2)) {
+		s->paused = false;
+		uv_read_start(s->src->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+	}
+}
+
+// Forward what src has buffered, returns false if dst can not be written to
+static bool splice_forward(pulsar_splice *s) {
+	pulsar_tcp_client *src = s->src, *dst = s->dst;
+	pulsar_read_buffer *rb = &src->read_buf;
+	size_t avail = read_buffer_size(rb);
+	if (!avail) return true;
+
+	size_t written = 0;
+	if (!dst->sock->write_queue_size) {
+		uv_buf_t buf = uv_buf_init(read_buffer_data(rb), avail);
+		int ret = uv_try_write(dst->sock, &buf, 1);
+		if (ret > 0) written = ret;
+	}
+	s->bytes += written;
+	s->loop->metrics.bytes_written += written;
+	if (written == avail) {
+		read_buffer_consume(rb, avail);
+		return true;
+	}
+
+	pulsar_splice_write *req = (pulsar_splice_write*)malloc(sizeof(pulsar_splice_write));
+	req->splice = s;
+	req->buf = rb->buf;
+	req->size = rb->buflen;
+	req->len = avail - written;
+	uv_buf_t buf = uv_buf_init(read_buffer_data(rb) + written, req->len);
+	read_buffer_init(rb);
+	if (uv_write((uv_write_t*)req, dst->sock, &buf, 1, splice_write_cb)) {
+		buffer_pool_put(&s->loop->pool, req->buf, req->size);
+		free(req);
+		return false;
+	}
+	s->writes++;
+	s->loop->metrics.writes_pending++;
+	s->loop->metrics.write_bytes_pending += req->len;
+
+	// Too much waits to be written, stop reading until it goes down
+	if (!s->paused && (dst->sock->write_queue_size >= s->bufsize)) {
+		s->paused = true;
+		uv_read_stop(src->sock);
+	}
+	return true;
+}
+
+// One of the sides closed, the coroutine gets the count of bytes written to dst
+static void splice_end(pulsar_splice *s, const char *reason) {
+	if (s->done) return;
+	s->done = true;
+	pulsar_tcp_client *src = s->src;
+	src->splice_out = NULL;
+	s->dst->splice_in = NULL;
+	if (s->paused && !src->closed && src->active)
+		uv_read_start(src->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+
+	lua_State *L = s->L;
+	lua_pushnumber(L, s->bytes);
+	lua_pushstring(L, reason);
+	pulsar_client_resume(src, L, 2);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->src_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->dst_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->L_ref);
+	if (!s->writes) free(s);
+}
+
+static int pulsar_tcp_client_pipe_to(lua_State *L) {
+	pulsar_tcp_client *src = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	pulsar_tcp_client *dst = (pulsar_tcp_client *)luaL_checkudata (L, 2, MT_PULSAR_TCP_CLIENT);
+	if (src == dst) { lua_pushstring(L, "can not pipe a client to itself"); lua_error(L); return 0; }
+	size_t bufsize = PULSAR_SPLICE_BUFSIZE;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "bufsize");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) > 0)) bufsize = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	const char *err = NULL;
+	if (src->closed || dst->closed) err = "disconnected";
+	else if (src->splice_out || dst->splice_in) err = "already piped";
+	else if (src->read_wait_len) err = "read in progress";
+	else if (dst->sendfile) err = "sendfile in progress";
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	if (lua_pushthread(L)) { lua_pushstring(L, "pipeTo must be called from a coroutine"); lua_error(L); return 0; }
+
+	pulsar_splice *s = (pulsar_splice*)malloc(sizeof(pulsar_splice));
+	s->L = L;
+	s->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	s->loop = src->loop;
+	s->src = src;
+	s->dst = dst;
+	lua_pushvalue(L, 1);
+	s->src_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	s->dst_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	s->bufsize = bufsize;
+	s->bytes = 0;
+	s->paused = false;
+	s->done = false;
+	s->writes = 0;
+	src->splice_out = s;
+	dst->splice_in = s;
+
+	if (!src->active) {
+		uv_read_start(src->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+		src->active = true;
+	}
+
+	// What was already received goes first
+	if (!splice_forward(s)) {
+		src->splice_out = NULL;
+		dst->splice_in = NULL;
+		if (s->paused) uv_read_start(src->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+		luaL_unref(L, LUA_REGISTRYINDEX, s->src_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, s->dst_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, s->L_ref);
+		free(s);
+		lua_pushnil(L);
+		lua_pushliteral(L, "write failed");
+		return 2;
+	}
+	return lua_yield(L, 0);
+}
+
+static void client_init(pulsar_tcp_client *client, pulsar_loop *loop, uv_stream_t *sock, bool standalone) {
+	client->loop = loop;
+	client->sock = sock;
+	client->sock->data = client;
+	client->pipe = (sock->type == UV_NAMED_PIPE);
+	client->closed = false;
+	client->active = false;
+	client->disconnected = false;
+
+	client->read_wait_ignorelen = 0;
+	client->read_wait_ignore = NULL;
+	client->read_wait_len = 0;
+	client->read_wait_until = NULL;
+	client->read_wait_untillen = 0;
+	client->read_wait_scanned = 0;
+	client->read_target = NULL;
+	client->read_target_ref = LUA_NOREF;
+	client->read_direct = false;
+	read_buffer_init(&client->read_buf);
+
+	client->write_high = 0;
+	client->write_low = 0;
+	client->wL = NULL;
+	client->wL_ref = LUA_NOREF;
+
+	client->standalone = standalone;
+	client->co = NULL;
+	client->co_ref = LUA_NOREF;
+
+	client->read_timeout = 0;
+	client->write_timeout = 0;
+	client->write_blocked = 0;
+	client->close_reason = NULL;
+	client->priority = PULSAR_CLASS_NORMAL;
+	client->sched_reads = 0;
+	client->sendfile = NULL;
+	client->sendfile_cancel = false;
+	client->splice_out = NULL;
+	client->splice_in = NULL;
+	client->pool = NULL;
+	loop->metrics.clients++;
+	loop->metrics.clients_total++;
+	wheel_node_init(&client->read_node, client_read_timeout_cb, client);
+	wheel_node_init(&client->write_node, client_write_timeout_cb, client);
+}
+
+// Reads the read and write fields, in seconds, of the table at idx
+static void timeouts_read(lua_State *L, int idx, uint64_t *read, uint64_t *write) {
+	lua_getfield(L, idx, "read");
+	if (lua_isnumber(L, -1)) *read = wheel_ms(lua_tonumber(L, -1));
+	lua_pop(L, 1);
+	lua_getfield(L, idx, "write");
+	if (lua_isnumber(L, -1)) *write = wheel_ms(lua_tonumber(L, -1));
+	lua_pop(L, 1);
+}
+
+static int pulsar_tcp_client_set_priority(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	client->priority = sched_class_check(L, 2);
+	return 0;
+}
+
+static int pulsar_tcp_client_set_timeouts(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	timeouts_read(L, 2, &client->read_timeout, &client->write_timeout);
+	return 0;
+}
+
+static void conn_pool_connected(pulsar_conn_pool *pool, pulsar_tcp_client *client);
+
+static void tcp_client_connect_done(pulsar_tcp_client_connect *con, pulsar_tcp_client *client, const char *err) {
+	lua_State *L = con->L;
+	int L_ref = con->L_ref;
+	pulsar_loop *loop = con->loop;
+	pulsar_owner owner = con->owner;
+	pulsar_conn_pool *pool = con->pool;
+	wheel_remove(&loop->wheel, &con->node);
+	free(con->addrs);
+	free(con);
+	if (pool) conn_pool_connected(pool, client);
+	if (client) owner_wakeup(loop, &owner, L, 1);
+	else {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		owner_wakeup(loop, &owner, L, 2);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+}
+
+static void tcp_client_connect_cb(uv_connect_t *_con, int status);
+
+// Tries the next addresses, each on a fresh socket, until a connection starts
+static bool tcp_client_connect_next(pulsar_tcp_client_connect *con) {
+	while (con->next_addr < con->nb_addrs) {
+		struct sockaddr_storage *addr = &con->addrs[con->next_addr++];
+		addr_set_port(addr, con->port);
+		con->sock = malloc(uv_handle_size(UV_TCP));
+		uv_tcp_init(con->loop->loop, (uv_tcp_t*)con->sock);
+		if (!uv_tcp_connect((uv_connect_t*)con, (uv_tcp_t*)con->sock, (const struct sockaddr*)addr, tcp_client_connect_cb)) return true;
+		uv_close((uv_handle_t*)con->sock, close_cb);
+	}
+	con->sock = NULL;
+	return false;
+}
+
+static void tcp_client_connect_cb(uv_connect_t *_con, int status) {
+	pulsar_tcp_client_connect *con = (pulsar_tcp_client_connect*)_con;
+	if (status) {
+		// A timed out connection was already closed
+		if (con->timed_out) {
+			tcp_client_connect_done(con, NULL, "timeout");
+			return;
+		}
+		uv_close((uv_handle_t*)con->sock, close_cb);
+		if (!tcp_client_connect_next(con)) tcp_client_connect_done(con, NULL, "could not connect");
+		return;
+	}
+
+	// Initialize and start watcher to read client requests
+	lua_State *L = con->L;
+	pulsar_tcp_client *client = (pulsar_tcp_client*)lua_newuserdata(L, sizeof(pulsar_tcp_client));
+	pulsar_setmeta(L, MT_PULSAR_TCP_CLIENT);
+	client_init(client, con->loop, con->sock, true);
+	client->read_timeout = con->read_timeout;
+	client->write_timeout = con->write_timeout;
+	tcp_client_connect_done(con, client, NULL);
+}
+
+static void tcp_client_resolved(void *data, int status, struct sockaddr_storage *addrs, int nb) {
+	pulsar_tcp_client_connect *con = (pulsar_tcp_client_connect*)data;
+	con->resolve = NULL;
+	if (con->timed_out || status) {
+		free(addrs);
+		tcp_client_connect_done(con, NULL, con->timed_out ? "timeout" : "could not resolve");
+		return;
+	}
+	con->addrs = addrs;
+	con->nb_addrs = nb;
+	if (!tcp_client_connect_next(con)) tcp_client_connect_done(con, NULL, "could not connect");
+}
+
+// Cancelling the resolution or closing the socket makes their callbacks run with an error
+static void tcp_client_connect_timeout_cb(pulsar_wheel_node *node) {
+	pulsar_tcp_client_connect *con = (pulsar_tcp_client_connect*)node->data;
+	con->timed_out = true;
+	if (con->resolve) uv_cancel((uv_req_t*)&con->resolve->req);
+	else uv_close((uv_handle_t*)con->sock, close_cb);
+}
+
+// Takes a reference to the calling coroutine, opts_idx may hold timeouts
+static pulsar_tcp_client_connect *tcp_client_connect_new(lua_State *L, pulsar_loop *loop, int opts_idx) {
+	pulsar_tcp_client_connect *req = (pulsar_tcp_client_connect*)malloc(sizeof(pulsar_tcp_client_connect));
+	lua_pushthread(L);
+	req->L = L;
+	req->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	req->owner = loop_owner(loop, L);
+	req->loop = loop;
+	req->sock = NULL;
+	req->timed_out = false;
+	req->read_timeout = 0;
+	req->write_timeout = 0;
+	req->resolve = NULL;
+	req->addrs = NULL;
+	req->nb_addrs = 0;
+	req->next_addr = 0;
+	req->port = 0;
+	req->pool = NULL;
+	wheel_node_init(&req->node, tcp_client_connect_timeout_cb, req);
+	if (opts_idx && lua_istable(L, opts_idx)) {
+		timeouts_read(L, opts_idx, &req->read_timeout, &req->write_timeout);
+		lua_getfield(L, opts_idx, "connect");
+		if (lua_isnumber(L, -1)) wheel_add(&loop->wheel, &req->node, wheel_ms(lua_tonumber(L, -1)));
+		lua_pop(L, 1);
+	}
+	return req;
+}
+
+/*
+** Numeric and cached hosts connect right away, the others are resolved first
+** If it can not even start the request is freed and the error returned
+*/
+static const char *tcp_client_connect_start(pulsar_tcp_client_connect *req, const char *address) {
+	pulsar_loop *loop = req->loop;
+	const char *err = NULL;
+	if (!dns_lookup(loop, address, &req->addrs, &req->nb_addrs)) {
+		if (!tcp_client_connect_next(req)) err = "could not connect";
+	} else {
+		req->resolve = dns_resolve(loop, address, tcp_client_resolved, req);
+		if (!req->resolve) err = "could not resolve";
+	}
+	if (err) {
+		wheel_remove(&loop->wheel, &req->node);
+		luaL_unref(req->L, LUA_REGISTRYINDEX, req->L_ref);
+		free(req->addrs);
+		free(req);
+	}
+	return err;
+}
+
+static int pulsar_tcp_client_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *address = luaL_checkstring(L, 2);
+	int port = luaL_checknumber(L, 3);
+	if (lua_pushthread(L)) { lua_pushstring(L, "tcpClient must be called from a coroutine"); lua_error(L); return 0; }
+	lua_pop(L, 1);
+
+	pulsar_tcp_client_connect *req = tcp_client_connect_new(L, loop, 4);
+	req->port = port;
+	const char *err = tcp_client_connect_start(req, address);
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	return lua_yield(L, 0);
+}
+
+static int pulsar_pipe_client_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *path = luaL_checkstring(L, 2);
+	if (lua_pushthread(L)) { lua_pushstring(L, "pipeClient must be called from a coroutine"); lua_error(L); return 0; }
+	lua_pop(L, 1);
+
+	// Without addresses a failed connect is final
+	pulsar_tcp_client_connect *req = tcp_client_connect_new(L, loop, 3);
+	req->sock = malloc(uv_handle_size(UV_NAMED_PIPE));
+	uv_pipe_init(loop->loop, (uv_pipe_t*)req->sock, 0);
+	uv_pipe_connect((uv_connect_t*)req, (uv_pipe_t*)req->sock, path, tcp_client_connect_cb);
+	return lua_yield(L, 0);
+}
+
+/**************************************************************************************
+ ** Connection pools
+ **************************************************************************************/
+static void conn_pool_wake(pulsar_conn_pool *pool);
+
+// Once nothing is out nor waited for, only Lua keeps the pool alive
+static void conn_pool_release_self(pulsar_conn_pool *pool) {
+	if ((pool->self_ref == LUA_NOREF) || pool->waking || (pool->total > pool->nb_idle) || pool->nb_waiting) return;
+	luaL_unref(pool->L, LUA_REGISTRYINDEX, pool->self_ref);
+	pool->self_ref = LUA_NOREF;
+}
+
+// Idle clients the peer closed or sent data to can not be reused
+static bool conn_pool_client_ok(pulsar_tcp_client *client) {
+	return !client->closed && !client->disconnected && !read_buffer_size(&client->read_buf);
+}
+
+// Pushes the most recently released idle client on L and takes it out of the stack
+static pulsar_tcp_client *conn_pool_pop_idle(pulsar_conn_pool *pool, lua_State *L) {
+	pulsar_conn_pool_idle *e = &pool->idle[--pool->nb_idle];
+	lua_rawgeti(L, LUA_REGISTRYINDEX, e->client_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, e->client_ref);
+	return e->client;
+}
+
+// The oldest idle client is at the bottom of the stack, the wheel fires when it expires
+static void conn_pool_sweep_arm(pulsar_conn_pool *pool) {
+	if (!pool->idle_timeout || !pool->nb_idle || pool->closed) {
+		wheel_remove(&pool->loop->wheel, &pool->sweep);
+		return;
+	}
+	uint64_t now = uv_now(pool->loop->loop);
+	uint64_t due = pool->idle[0].since + pool->idle_timeout;
+	wheel_add(&pool->loop->wheel, &pool->sweep, (due > now) ? due - now : 1);
+}
+
+static void conn_pool_sweep_cb(pulsar_wheel_node *node) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)node->data;
+	uint64_t now = uv_now(pool->loop->loop);
+	while (pool->nb_idle && (pool->idle[0].since + pool->idle_timeout <= now)) {
+		pool->expired++;
+		client_close(pool->idle[0].client);
+	}
+	conn_pool_sweep_arm(pool);
+}
+
+// A client of the pool closed, its slot is free again
+static void conn_pool_detach(pulsar_tcp_client *client) {
+	pulsar_conn_pool *pool = client->pool;
+	client->pool = NULL;
+	int i;
+	for (i = 0; i < pool->nb_idle; i++) {
+		if (pool->idle[i].client != client) continue;
+		luaL_unref(pool->L, LUA_REGISTRYINDEX, pool->idle[i].client_ref);
+		memmove(&pool->idle[i], &pool->idle[i + 1], (pool->nb_idle - i - 1) * sizeof(pulsar_conn_pool_idle));
+		pool->nb_idle--;
+		break;
+	}
+	pool->total--;
+	conn_pool_wake(pool);
+	conn_pool_release_self(pool);
+}
+
+static const char *conn_pool_connect(pulsar_conn_pool *pool, lua_State *L, pulsar_owner *owner) {
+	pulsar_tcp_client_connect *req = tcp_client_connect_new(L, pool->loop, 0);
+	req->owner = *owner;
+	req->port = pool->port;
+	req->pool = pool;
+	req->read_timeout = pool->read_timeout;
+	req->write_timeout = pool->write_timeout;
+	if (pool->connect_timeout) wheel_add(&pool->loop->wheel, &req->node, pool->connect_timeout);
+	return tcp_client_connect_start(req, pool->host);
+}
+
+// Called before the connecting coroutine is resumed
+static void conn_pool_connected(pulsar_conn_pool *pool, pulsar_tcp_client *client) {
+	if (client && !pool->closed) {
+		client->pool = pool;
+		return;
+	}
+	pool->total--;
+	conn_pool_wake(pool);
+	conn_pool_release_self(pool);
+}
+
+/*
+** Hand idle clients, or free slots to connect on, to the coroutines waiting in acquire,
+** oldest first
+*/
+static void conn_pool_wake(pulsar_conn_pool *pool) {
+	if (pool->waking) return;
+	pool->waking = true;
+	while (pool->wait_head && !pool->closed && (pool->nb_idle || (pool->total < pool->max))) {
+		if (pool->nb_idle && !conn_pool_client_ok(pool->idle[pool->nb_idle - 1].client)) {
+			pool->discarded++;
+			client_close(pool->idle[pool->nb_idle - 1].client);
+			continue;
+		}
+
+		pulsar_conn_pool_waiter *w = pool->wait_head;
+		pool->wait_head = w->next;
+		if (!pool->wait_head) pool->wait_tail = NULL;
+		pool->nb_waiting--;
+		lua_State *L = w->L;
+		int L_ref = w->L_ref;
+		pulsar_owner owner = w->owner;
+		free(w);
+
+		if (pool->nb_idle) {
+			pool->hits++;
+			conn_pool_pop_idle(pool, L);
+			owner_wakeup(pool->loop, &owner, L, 1);
+		} else {
+			pool->misses++;
+			pool->total++;
+			const char *err = conn_pool_connect(pool, L, &owner);
+			if (err) {
+				pool->total--;
+				lua_pushnil(L);
+				lua_pushstring(L, err);
+				owner_wakeup(pool->loop, &owner, L, 2);
+			}
+		}
+		luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+	}
+	pool->waking = false;
+	conn_pool_sweep_arm(pool);
+}
+
+static int pulsar_conn_pool_acquire(lua_State *L) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)luaL_checkudata (L, 1, MT_PULSAR_CONN_POOL);
+	if (pool->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "closed");
+		return 2;
+	}
+	if (lua_pushthread(L)) { lua_pushstring(L, "acquire must be called from a coroutine"); lua_error(L); return 0; }
+	lua_pop(L, 1);
+	if (pool->self_ref == LUA_NOREF) {
+		lua_pushvalue(L, 1);
+		pool->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	while (pool->nb_idle) {
+		pulsar_tcp_client *client = pool->idle[pool->nb_idle - 1].client;
+		if (!conn_pool_client_ok(client)) {
+			pool->discarded++;
+			client_close(client);
+			continue;
+		}
+		pool->hits++;
+		conn_pool_pop_idle(pool, L);
+		conn_pool_sweep_arm(pool);
+		return 1;
+	}
+
+	if (pool->total < pool->max) {
+		pool->misses++;
+		pool->total++;
+		pulsar_owner owner = loop_owner(pool->loop, L);
+		const char *err = conn_pool_connect(pool, L, &owner);
+		if (err) {
+			pool->total--;
+			conn_pool_release_self(pool);
+			lua_pushnil(L);
+			lua_pushstring(L, err);
+			return 2;
+		}
+		return lua_yield(L, 0);
+	}
+
+	// All the connections are out, wait for one to come back or close
+	pool->waits++;
+	pulsar_conn_pool_waiter *w = (pulsar_conn_pool_waiter*)malloc(sizeof(pulsar_conn_pool_waiter));
+	lua_pushthread(L);
+	w->L = L;
+	w->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	w->owner = loop_owner(pool->loop, L);
+	w->next = NULL;
+	if (pool->wait_tail) pool->wait_tail->next = w;
+	else pool->wait_head = w;
+	pool->wait_tail = w;
+	pool->nb_waiting++;
+	return lua_yield(L, 0);
+}
+
+/*
+** Clients still busy, with unread data or closed are not worth keeping and get closed
+** Idle clients keep reading so that a close by the peer is noticed
+*/
+static int pulsar_conn_pool_release(lua_State *L) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)luaL_checkudata (L, 1, MT_PULSAR_CONN_POOL);
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 2, MT_PULSAR_TCP_CLIENT);
+	if (client->pool != pool) {
+		if (client->closed) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		lua_pushstring(L, "client does not belong to this pool");
+		lua_error(L);
+		return 0;
+	}
+	int i;
+	for (i = 0; i < pool->nb_idle; i++) {
+		if (pool->idle[i].client != client) continue;
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if (pool->closed || !conn_pool_client_ok(client) || client->read_wait_len || client->wL || client->write_blocked
+		|| client->sock->write_queue_size || client->splice_out || client->splice_in || client->sendfile) {
+		pool->discarded++;
+		client_close(client);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	if (!client->active) {
+		uv_read_start(client->sock, tcp_client_buf_alloc, tcp_client_read_cb);
+		client->active = true;
+	}
+	pulsar_conn_pool_idle *e = &pool->idle[pool->nb_idle++];
+	e->client = client;
+	lua_pushvalue(L, 2);
+	e->client_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	e->since = uv_now(pool->loop->loop);
+	conn_pool_wake(pool);
+	conn_pool_release_self(pool);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int pulsar_conn_pool_stats(lua_State *L) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)luaL_checkudata (L, 1, MT_PULSAR_CONN_POOL);
+	lua_newtable(L);
+	lua_pushnumber(L, pool->total); lua_setfield(L, -2, "total");
+	lua_pushnumber(L, pool->nb_idle); lua_setfield(L, -2, "idle");
+	lua_pushnumber(L, pool->nb_waiting); lua_setfield(L, -2, "waiting");
+	lua_pushnumber(L, pool->max); lua_setfield(L, -2, "max");
+	lua_pushnumber(L, pool->hits); lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, pool->misses); lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, pool->waits); lua_setfield(L, -2, "waits");
+	lua_pushnumber(L, pool->discarded); lua_setfield(L, -2, "discarded");
+	lua_pushnumber(L, pool->expired); lua_setfield(L, -2, "expired");
+	return 1;
+}
+
+static int pulsar_conn_pool_close(lua_State *L) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)luaL_checkudata (L, 1, MT_PULSAR_CONN_POOL);
+	if (pool->closed) return 0;
+	pool->closed = true;
+	wheel_remove(&pool->loop->wheel, &pool->sweep);
+
+	while (pool->wait_head) {
+		pulsar_conn_pool_waiter *w = pool->wait_head;
+		pool->wait_head = w->next;
+		pool->nb_waiting--;
+		lua_pushnil(w->L);
+		lua_pushliteral(w->L, "closed");
+		owner_wakeup(pool->loop, &w->owner, w->L, 2);
+		luaL_unref(w->L, LUA_REGISTRYINDEX, w->L_ref);
+		free(w);
+	}
+	pool->wait_tail = NULL;
+	while (pool->nb_idle) client_close(pool->idle[pool->nb_idle - 1].client);
+	return 0;
+}
+
+static int pulsar_conn_pool_free(lua_State *L) {
+	pulsar_conn_pool *pool = (pulsar_conn_pool *)luaL_checkudata (L, 1, MT_PULSAR_CONN_POOL);
+	pulsar_conn_pool_close(L);
+	free(pool->host);
+	free(pool->idle);
+	pool->host = NULL;
+	pool->idle = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, pool->L_ref);
+	return 0;
+}
+
+static int pulsar_conn_pool_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *host = luaL_checkstring(L, 2);
+	int port = luaL_checknumber(L, 3);
+
+	int max = PULSAR_CONN_POOL_MAX;
+	uint64_t idle_timeout = PULSAR_CONN_POOL_IDLE_TIMEOUT, connect_timeout = 0, read_timeout = 0, write_timeout = 0;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "max");
+		if (lua_isnumber(L, -1)) max = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "idle_timeout");
+		if (lua_isnumber(L, -1)) idle_timeout = wheel_ms(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "connect");
+		if (lua_isnumber(L, -1)) connect_timeout = wheel_ms(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+		timeouts_read(L, 4, &read_timeout, &write_timeout);
+	}
+	if (max < 1) max = 1;
+
+	pulsar_conn_pool *pool = (pulsar_conn_pool*)lua_newuserdata(L, sizeof(pulsar_conn_pool));
+	pulsar_setmeta(L, MT_PULSAR_CONN_POOL);
+	pool->loop = loop;
+	lua_pushthread(L);
+	pool->L = L;
+	pool->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pool->self_ref = LUA_NOREF;
+	pool->waking = false;
+	pool->host = strdup(host);
+	pool->port = port;
+	pool->connect_timeout = connect_timeout;
+	pool->read_timeout = read_timeout;
+	pool->write_timeout = write_timeout;
+	pool->total = 0;
+	pool->max = max;
+	pool->idle = (pulsar_conn_pool_idle*)malloc(max * sizeof(pulsar_conn_pool_idle));
+	pool->nb_idle = 0;
+	pool->idle_timeout = idle_timeout;
+	wheel_node_init(&pool->sweep, conn_pool_sweep_cb, pool);
+	pool->wait_head = pool->wait_tail = NULL;
+	pool->nb_waiting = 0;
+	pool->closed = false;
+	pool->hits = pool->misses = pool->waits = pool->discarded = pool->expired = 0;
+	return 1;
+}
+
+/**************************************************************************************
+ ** TCP Server calls
+ **************************************************************************************/
+static void tcp_server_accept_cb(uv_stream_t *_watcher, int status) {
+	pulsar_tcp_server *serv = (pulsar_tcp_server *)_watcher->data;
+	if (status < 0) {
+		serv->loop->metrics.accept_errors++;
+		return;
+	}
+
+	// Initialize and start watcher to read client requests
+	lua_rawgeti(serv->L, LUA_REGISTRYINDEX, serv->client_fct_ref);
+	pulsar_tcp_client *client = (pulsar_tcp_client*)lua_newuserdata(serv->L, sizeof(pulsar_tcp_client));
+	pulsar_setmeta(serv->L, MT_PULSAR_TCP_CLIENT);
+	uv_stream_t *sock;
+	if (serv->pipe) {
+		sock = malloc(uv_handle_size(UV_NAMED_PIPE));
+		uv_pipe_init(serv->loop->loop, (uv_pipe_t*)sock, 0);
+	} else {
+		sock = malloc(uv_handle_size(UV_TCP));
+		uv_tcp_init(serv->loop->loop, (uv_tcp_t*)sock);
+	}
+	client_init(client, serv->loop, sock, false);
+	client->read_timeout = serv->read_timeout;
+	client->write_timeout = serv->write_timeout;
+	client->priority = serv->priority;
+	if (uv_accept(_watcher, (uv_stream_t*)client->sock)) {
+		client->closed = true;
+		uv_close((uv_handle_t*)client->sock, close_cb);
+		lua_pop(serv->L, 2);
+		serv->loop->metrics.accept_errors++;
+		serv->loop->metrics.clients--;
+		if (serv->loop->cluster) serv->loop->cluster->accept_errors++;
+		return;
+	}
+	serv->loop->metrics.accepts++;
+	if (serv->loop->cluster) {
+		serv->loop->cluster->accepts++;
+		serv->loop->cluster->clients++;
+	}
+
+	lua_State *L = pulsar_co_acquire(serv->loop, serv->L, &client->co_ref);
+	client->co = L;
+	lua_xmove(serv->L, L, 2);
+	pulsar_client_resume(client, L, 1);
+}
+
+static int pulsar_tcp_server_close(lua_State *L) {
+	pulsar_tcp_server *serv = (pulsar_tcp_server *)luaL_checkudata (L, 1, MT_PULSAR_TCP_SERVER);
+	uv_close((uv_handle_t*)serv->sock, close_cb);
+	serv->active = false;
+	luaL_unref(L, LUA_REGISTRYINDEX, serv->client_fct_ref);
+	return 0;
+}
+static int pulsar_tcp_server_start(lua_State *L) {
+	pulsar_tcp_server *serv = (pulsar_tcp_server *)luaL_checkudata (L, 1, MT_PULSAR_TCP_SERVER);
+	uv_listen((uv_stream_t*)serv->sock, 128, tcp_server_accept_cb);
+	serv->active = true;
+	return 0;
+}
+
+/*
+** Let several sockets, generally one per cluster thread, bind the same port and
+** have the kernel balance the connections between them
+*/
+static int tcp_server_reuseport(uv_tcp_t *sock, int family) {
+#ifdef SO_REUSEPORT
+	int fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) || uv_tcp_open(sock, fd)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+// Pushes a server for the bound sock
+static void tcp_server_push(lua_State *L, pulsar_loop *loop, uv_stream_t *sock, int fct_ref, pulsar_tcp_server_opts *opts) {
+	// Initialize and start a watcher to accepts client requests
+	pulsar_tcp_server *serv = (pulsar_tcp_server*)lua_newuserdata(L, sizeof(pulsar_tcp_server));
+	pulsar_setmeta(L, MT_PULSAR_TCP_SERVER);
+	serv->sock = sock;
+	serv->sock->data = serv;
+	serv->pipe = (sock->type == UV_NAMED_PIPE);
+	serv->L = L;
+	serv->loop = loop;
+	serv->active = false;
+	serv->read_timeout = opts->read_timeout;
+	serv->write_timeout = opts->write_timeout;
+	serv->priority = opts->priority;
+	serv->client_fct_ref = fct_ref;
+}
+
+// Binds a server and pushes it, or nil and an error, fct_ref is released on errors
+static int tcp_server_create(lua_State *L, pulsar_loop *loop, struct sockaddr_storage *bind_addr, int fct_ref, pulsar_tcp_server_opts *opts) {
+	uv_tcp_t *sock = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
+	uv_tcp_init(loop->loop, sock);
+	if (opts->reuseport && tcp_server_reuseport(sock, bind_addr->ss_family)) {
+		uv_close((uv_handle_t*)sock, close_cb);
+		luaL_unref(L, LUA_REGISTRYINDEX, fct_ref);
+		lua_pushnil(L);
+		lua_pushliteral(L, "reuseport not available");
+		return 2;
+	}
+	if (uv_tcp_bind(sock, (const struct sockaddr*)bind_addr)) {
+		uv_close((uv_handle_t*)sock, close_cb);
+		luaL_unref(L, LUA_REGISTRYINDEX, fct_ref);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not bind");
+		return 2;
+	}
+	tcp_server_push(L, loop, (uv_stream_t*)sock, fct_ref, opts);
+	return 1;
+}
+
+// Reads the options shared by tcpServer and pipeServer
+static void tcp_server_opts_read(lua_State *L, int idx, pulsar_tcp_server_opts *opts) {
+	opts->reuseport = false;
+	opts->read_timeout = 0;
+	opts->write_timeout = 0;
+	opts->priority = PULSAR_CLASS_NORMAL;
+	if (!lua_istable(L, idx)) return;
+	lua_getfield(L, idx, "reuseport");
+	opts->reuseport = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	timeouts_read(L, idx, &opts->read_timeout, &opts->write_timeout);
+	lua_getfield(L, idx, "priority");
+	if (!lua_isnil(L, -1)) opts->priority = sched_class_check(L, -1);
+	lua_pop(L, 1);
+}
+
+static int pulsar_pipe_server_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *path = luaL_checkstring(L, 2);
+	if (!lua_isfunction(L, 3)) { lua_pushstring(L, "argument 2 is not a function"); lua_error(L); return 0; }
+	pulsar_tcp_server_opts opts;
+	tcp_server_opts_read(L, 4, &opts);
+
+	uv_pipe_t *sock = (uv_pipe_t*)malloc(sizeof(uv_pipe_t));
+	uv_pipe_init(loop->loop, sock, 0);
+	if (uv_pipe_bind(sock, path)) {
+		uv_close((uv_handle_t*)sock, close_cb);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not bind");
+		return 2;
+	}
+	lua_pushvalue(L, 3);
+	tcp_server_push(L, loop, (uv_stream_t*)sock, luaL_ref(L, LUA_REGISTRYINDEX), &opts);
+	return 1;
+}
+
+// Binds on the first address the host resolved to
+static void tcp_server_resolved(void *data, int status, struct sockaddr_storage *addrs, int nb) {
+	pulsar_tcp_server_resolve *res = (pulsar_tcp_server_resolve*)data;
+	lua_State *L = res->L;
+	int nret;
+	if (status) {
+		luaL_unref(L, LUA_REGISTRYINDEX, res->fct_ref);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not resolve");
+		nret = 2;
+	} else {
+		addr_set_port(&addrs[0], res->port);
+		nret = tcp_server_create(L, res->loop, &addrs[0], res->fct_ref, &res->opts);
+	}
+	free(addrs);
+	owner_wakeup(res->loop, &res->owner, L, nret);
+	luaL_unref(L, LUA_REGISTRYINDEX, res->L_ref);
+	free(res);
+}
+
+static int pulsar_tcp_server_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *address = luaL_checkstring(L, 2);
+	int port = luaL_checknumber(L, 3);
+	if (!lua_isfunction(L, 4)) { lua_pushstring(L, "argument 3 is not a function"); lua_error(L); return 0; }
+
+	pulsar_tcp_server_opts opts;
+	tcp_server_opts_read(L, 5, &opts);
+
+	// Numeric and cached hosts bind right away, names are resolved when in a coroutine
+	struct sockaddr_storage *addrs;
+	int nb;
+	if (!dns_lookup(loop, address, &addrs, &nb)) {
+		addr_set_port(&addrs[0], port);
+		lua_pushvalue(L, 4);
+		int nret = tcp_server_create(L, loop, &addrs[0], luaL_ref(L, LUA_REGISTRYINDEX), &opts);
+		free(addrs);
+		return nret;
+	}
+	if (lua_pushthread(L)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "host names can only be resolved from a coroutine");
+		return 2;
+	}
+
+	pulsar_tcp_server_resolve *res = (pulsar_tcp_server_resolve*)malloc(sizeof(pulsar_tcp_server_resolve));
+	res->loop = loop;
+	res->L = L;
+	res->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	res->owner = loop_owner(loop, L);
+	lua_pushvalue(L, 4);
+	res->fct_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	res->port = port;
+	res->opts = opts;
+	if (!dns_resolve(loop, address, tcp_server_resolved, res)) {
+		luaL_unref(L, LUA_REGISTRYINDEX, res->fct_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, res->L_ref);
+		free(res);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not resolve");
+		return 2;
+	}
+	return lua_yield(L, 0);
+}
+
+/**************************************************************************************
+ ** Files
+ **************************************************************************************/
+// fopen style modes
+static int fs_flags(const char *mode) {
+	int flags;
+	switch (mode[0]) {
+		case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+		default: flags = O_RDONLY; break;
+	}
+	if (strchr(mode, '+')) flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+	return flags;
+}
+
+static void fs_push_stat(lua_State *L, const uv_stat_t *st) {
+	lua_newtable(L);
+	lua_pushnumber(L, st->st_size); lua_setfield(L, -2, "size");
+	lua_pushnumber(L, st->st_mode & 07777); lua_setfield(L, -2, "mode");
+	lua_pushboolean(L, S_ISDIR(st->st_mode)); lua_setfield(L, -2, "is_dir");
+	lua_pushboolean(L, S_ISREG(st->st_mode)); lua_setfield(L, -2, "is_file");
+	lua_pushnumber(L, st->st_mtim.tv_sec + st->st_mtim.tv_nsec / 1e9); lua_setfield(L, -2, "mtime");
+	lua_pushnumber(L, st->st_atim.tv_sec + st->st_atim.tv_nsec / 1e9); lua_setfield(L, -2, "atime");
+	lua_pushnumber(L, st->st_ctim.tv_sec + st->st_ctim.tv_nsec / 1e9); lua_setfield(L, -2, "ctime");
+}
+
+static void fs_cb(uv_fs_t *_req) {
+	pulsar_fs_req *req = (pulsar_fs_req*)_req;
+	lua_State *L = req->L;
+	ssize_t result = req->req.result;
+	int nret = 1;
+
+	if (req->buffer) req->buffer->pins--;
+	if (result < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, uv_strerror(result));
+		nret = 2;
+		if ((req->op == PULSAR_FS_READ) && !req->buffer) free(req->buf);
+	} else switch (req->op) {
+		case PULSAR_FS_OPEN: lua_pushnumber(L, result); break;
+		case PULSAR_FS_READ:
+			if (req->buffer) {
+				req->buffer->len += result;
+				lua_rawgeti(L, LUA_REGISTRYINDEX, req->data_ref);
+			} else {
+				lua_pushlstring(L, req->buf, result);
+				free(req->buf);
+			}
+			break;
+		case PULSAR_FS_WRITE: lua_pushnumber(L, result); break;
+		case PULSAR_FS_STAT: fs_push_stat(L, &req->req.statbuf); break;
+		default: lua_pushboolean(L, 1); break;
+	}
+
+	if (req->data_ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, req->data_ref);
+	uv_fs_req_cleanup(&req->req);
+	owner_wakeup(req->loop, &req->owner, L, nret);
+	luaL_unref(L, LUA_REGISTRYINDEX, req->L_ref);
+	free(req);
+}
+
+static pulsar_fs_req *fs_req_new(lua_State *L, pulsar_loop *loop, int op) {
+	if (lua_pushthread(L)) { lua_pushstring(L, "file operations must be called from a coroutine"); lua_error(L); return NULL; }
+	pulsar_fs_req *req = (pulsar_fs_req*)malloc(sizeof(pulsar_fs_req));
+	req->op = op;
+	req->loop = loop;
+	req->L = L;
+	req->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	req->owner = loop_owner(loop, L);
+	req->buf = NULL;
+	req->len = 0;
+	req->buffer = NULL;
+	req->data_ref = LUA_NOREF;
+	return req;
+}
+
+// Requests that could not even start report their error right away
+static int fs_started(lua_State *L, pulsar_fs_req *req, int ret) {
+	if (!ret) return lua_yield(L, 0);
+	if (req->buffer) req->buffer->pins--;
+	if ((req->op == PULSAR_FS_READ) && !req->buffer) free(req->buf);
+	if (req->data_ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, req->data_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, req->L_ref);
+	free(req);
+	lua_pushnil(L);
+	lua_pushstring(L, uv_strerror(ret));
+	return 2;
+}
+
+static int pulsar_fs_open(lua_State *L) {
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *path = luaL_checkstring(L, 2);
+	int flags = fs_flags(luaL_optstring(L, 3, "r"));
+	int mode = luaL_optnumber(L, 4, 0644);
+	pulsar_fs_req *req = fs_req_new(L, loop, PULSAR_FS_OPEN);
+	return fs_started(L, req, uv_fs_open(loop->loop, &req->req, path, flags, mode, fs_cb));
+}
+
+/*
+** Reads up to len bytes at offset (-1 or nil for the current position), into a new string
+** or appended to the given buffer
+*/
+static int pulsar_fs_read(lua_State *L) {
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	int fd = luaL_checknumber(L, 2);
+	lua_Number n = luaL_checknumber(L, 3);
+	int64_t offset = luaL_optnumber(L, 4, -1);
+	pulsar_buffer *buffer = pulsar_tobuffer(L, 5);
+	// uv_buf_t lengths are unsigned ints
+	if ((n < 0) || (n > INT_MAX)) { lua_pushstring(L, "read length out of range"); lua_error(L); return 0; }
+	if (buffer && buffer->pins) { lua_pushstring(L, "buffer is in use"); lua_error(L); return 0; }
+	size_t len = n;
+
+	pulsar_fs_req *req = fs_req_new(L, loop, PULSAR_FS_READ);
+	req->buf = buffer ? buffer_reserve(buffer, len) : malloc(len ? len : 1);
+	if (!req->buf) {
+		luaL_unref(L, LUA_REGISTRYINDEX, req->L_ref);
+		free(req);
+		lua_pushstring(L, "not enough memory"); lua_error(L); return 0;
+	}
+	if (buffer) {
+		req->buffer = buffer;
+		buffer->pins++;
+		lua_pushvalue(L, 5);
+		req->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	req->len = len;
+	uv_buf_t buf = uv_buf_init(req->buf, len);
+	return fs_started(L, req, uv_fs_read(loop->loop, &req->req, fd, &buf, 1, offset, fs_cb));
+}
+
+static int pulsar_fs_write(lua_State *L) {
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	int fd = luaL_checknumber(L, 2);
+	int64_t offset = luaL_optnumber(L, 4, -1);
+	size_t len;
+	const char *data;
+	pulsar_buffer *buffer = pulsar_tobuffer(L, 3);
+	if (buffer) {
+		data = buffer->data;
+		len = buffer->len;
+	}
+	else data = luaL_checklstring(L, 3, &len);
+
+	// The data stays referenced until written
+	pulsar_fs_req *req = fs_req_new(L, loop, PULSAR_FS_WRITE);
+	lua_pushvalue(L, 3);
+	req->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	req->buffer = buffer;
+	if (buffer) buffer->pins++;
+	uv_buf_t buf = uv_buf_init((char*)data, len);
+	return fs_started(L, req, uv_fs_write(loop->loop, &req->req, fd, &buf, 1, offset, fs_cb));
+}
+
+static int pulsar_fs_stat(lua_State *L) {
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_fs_req *req;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		int fd = lua_tonumber(L, 2);
+		req = fs_req_new(L, loop, PULSAR_FS_STAT);
+		return fs_started(L, req, uv_fs_fstat(loop->loop, &req->req, fd, fs_cb));
+	}
+	const char *path = luaL_checkstring(L, 2);
+	req = fs_req_new(L, loop, PULSAR_FS_STAT);
+	return fs_started(L, req, uv_fs_stat(loop->loop, &req->req, path, fs_cb));
+}
+
+static int pulsar_fs_close(lua_State *L) {
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	int fd = luaL_checknumber(L, 2);
+	pulsar_fs_req *req = fs_req_new(L, loop, PULSAR_FS_CLOSE);
+	return fs_started(L, req, uv_fs_close(loop->loop, &req->req, fd, fs_cb));
+}
+
+/*
+** sendFile: threads of libuv's pool read the file in chunks, opening it and finding its size
+** first if needed, and the loop writes each chunk behind what is already queued. Two buffers
+** let the next chunk be read while the last one is written, a thread is only held for one read
+*/
+static void sendfile_read_work(uv_work_t *_req) {
+	pulsar_sendfile *req = (pulsar_sendfile*)_req;
+	if (req->fd < 0) {
+		req->fd = open(req->path, O_RDONLY);
+		if (req->fd < 0) { req->err = -errno; return; }
+	}
+	if (req->len < 0) {
+		struct stat st;
+		if (fstat(req->fd, &st)) { req->err = -errno; return; }
+		req->len = (st.st_size > req->offset) ? st.st_size - req->offset : 0;
+	}
+	size_t chunk = req->bufsize;
+	if (chunk > req->len) chunk = req->len;
+	if (!chunk) { req->nread = 0; return; }
+	do req->nread = pread(req->fd, req->bufs[req->rbuf], chunk, req->offset);
+	while ((req->nread < 0) && (errno == EINTR));
+	if (req->nread < 0) req->err = -errno;
+}
+
+static void sendfile_pump(pulsar_sendfile *req);
+
+static void sendfile_read_done(uv_work_t *_req, int status) {
+	pulsar_sendfile *req = (pulsar_sendfile*)_req;
+	req->reading = false;
+	if (status && !req->err) req->err = status;
+	if (!req->err) {
+		// A file shorter than asked ends the transfer early
+		if (req->nread <= 0) req->eof = true;
+		else {
+			req->blen[req->rbuf] = req->nread;
+			req->rbuf ^= 1;
+			req->offset += req->nread;
+			req->len -= req->nread;
+			if (!req->len) req->eof = true;
+		}
+	}
+	sendfile_pump(req);
+}
+
+static void sendfile_write_cb(uv_write_t *_req, int status) {
+	pulsar_sendfile *req = (pulsar_sendfile*)_req->data;
+	size_t len = req->blen[req->wbuf];
+	pulsar_metrics *metrics = &req->client->loop->metrics;
+	metrics->writes_pending--;
+	metrics->write_bytes_pending -= len;
+	req->writing = false;
+	if (status) {
+		if (!req->err) req->err = status;
+	} else {
+		metrics->bytes_written += len;
+		req->sent += len;
+	}
+	req->blen[req->wbuf] = 0;
+	req->wbuf ^= 1;
+	sendfile_pump(req);
+}
+
+static void sendfile_free(lua_State *L, pulsar_sendfile *req) {
+	pulsar_buffer_pool *pool = &req->client->loop->pool;
+	int i;
+	if (req->path && (req->fd >= 0)) close(req->fd);
+	free(req->path);
+	for (i = 0; i < 2; i++) if (req->bufs[i]) buffer_pool_put(pool, req->bufs[i], req->bufsize);
+	luaL_unref(L, LUA_REGISTRYINDEX, req->L_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, req->client_ref);
+	free(req);
+}
+
+static void sendfile_finish(pulsar_sendfile *req) {
+	pulsar_tcp_client *client = req->client;
+	lua_State *L = req->L;
+	client->sendfile = NULL;
+	client->sendfile_cancel = false;
+
+	int nret = 1;
+	if (req->err || client->closed) {
+		lua_pushnil(L);
+		lua_pushstring(L, client->closed ? (client->close_reason ? client->close_reason : "disconnected") : uv_strerror(req->err));
+		nret = 2;
+	}
+	else lua_pushnumber(L, req->sent);
+	pulsar_client_resume(client, L, nret);
+	sendfile_free(L, req);
+}
+
+// Starts what can run, the write of a full buffer and the read into a free one
+static void sendfile_pump(pulsar_sendfile *req) {
+	pulsar_tcp_client *client = req->client;
+	bool stop = req->err || client->sendfile_cancel;
+
+	size_t len = req->blen[req->wbuf];
+	if (!stop && !req->writing && len) {
+		uv_buf_t buf = uv_buf_init(req->bufs[req->wbuf], len);
+		int err = uv_write(&req->wreq, (uv_stream_t*)client->sock, &buf, 1, sendfile_write_cb);
+		if (err) {
+			req->err = err;
+			stop = true;
+		} else {
+			req->writing = true;
+			client->loop->metrics.writes_pending++;
+			client->loop->metrics.write_bytes_pending += len;
+		}
+	}
+	if (!stop && !req->reading && !req->eof && !req->blen[req->rbuf]) {
+		req->reading = true;
+		uv_queue_work(client->loop->loop, &req->req, sendfile_read_work, sendfile_read_done);
+	}
+	if (req->reading || req->writing) return;
+	if (stop || req->eof) sendfile_finish(req);
+}
+
+/*
+** The file is queued behind the writes already pending, sends made while it goes return
+** nil and "sendfile in progress"
+*/
+static int pulsar_tcp_client_send_file(lua_State *L) {
+	pulsar_tcp_client *client = (pulsar_tcp_client *)luaL_checkudata (L, 1, MT_PULSAR_TCP_CLIENT);
+	const char *path = (lua_type(L, 2) == LUA_TNUMBER) ? NULL : luaL_checkstring(L, 2);
+	int64_t offset = luaL_optnumber(L, 3, 0);
+	int64_t len = luaL_optnumber(L, 4, -1);
+	if (client->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "disconnected");
+		return 2;
+	}
+	if (client->sendfile) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "sendfile in progress");
+		return 2;
+	}
+	if (!path && !len) {
+		lua_pushnumber(L, 0);
+		return 1;
+	}
+	if (lua_pushthread(L)) { lua_pushstring(L, "sendFile must be called from a coroutine"); lua_error(L); return 0; }
+
+	pulsar_sendfile *req = (pulsar_sendfile*)malloc(sizeof(pulsar_sendfile));
+	req->L = L;
+	req->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 1);
+	req->client = client;
+	req->client_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	req->wreq.data = req;
+	req->path = path ? strdup(path) : NULL;
+	req->fd = path ? -1 : lua_tonumber(L, 2);
+	req->offset = offset;
+	req->len = len;
+	req->bufs[0] = buffer_pool_get(&client->loop->pool, PULSAR_SENDFILE_CHUNK, &req->bufsize);
+	req->bufs[1] = buffer_pool_get(&client->loop->pool, PULSAR_SENDFILE_CHUNK, &req->bufsize);
+	req->blen[0] = req->blen[1] = 0;
+	req->rbuf = req->wbuf = 0;
+	req->reading = req->writing = req->eof = false;
+	req->nread = 0;
+	req->sent = 0;
+	req->err = 0;
+
+	client->sendfile = req;
+	client->sendfile_cancel = false;
+	sendfile_pump(req);
+	return lua_yield(L, 0);
+}
+
+/**************************************************************************************
+ ** UDP
+ **************************************************************************************/
+static pulsar_udp_packet *udp_packet_shift(pulsar_udp *udp) {
+	pulsar_udp_packet *p = udp->head;
+	udp->head = p->next;
+	if (!udp->head) udp->tail = NULL;
+	udp->nb--;
+	return p;
+}
+
+static void udp_packet_free(pulsar_udp *udp, pulsar_udp_packet *p) {
+	buffer_pool_put(&udp->loop->pool, (char*)p, p->size);
+}
+
+// Pushes data, host and port of the oldest datagram
+static void udp_push_packet(pulsar_udp *udp, lua_State *L) {
+	pulsar_udp_packet *p = udp_packet_shift(udp);
+	lua_pushlstring(L, p->data, p->len);
+	push_sockaddr(L, (const struct sockaddr*)&p->addr);
+	udp_packet_free(udp, p);
+}
+
+// Pushes a list of up to max {data, host, port} datagrams
+static void udp_push_batch(pulsar_udp *udp, lua_State *L, int max) {
+	int i = 1;
+	lua_createtable(L, (udp->nb < max) ? udp->nb : max, 0);
+	while (udp->head && (i <= max)) {
+		lua_createtable(L, 3, 0);
+		udp_push_packet(udp, L);
+		lua_rawseti(L, -4, 3);
+		lua_rawseti(L, -3, 2);
+		lua_rawseti(L, -2, 1);
+		lua_rawseti(L, -2, i++);
+	}
+}
+
+static void udp_read_resume(pulsar_udp *udp) {
+	if (!udp->rL || !udp->head) return;
+	lua_State *rL = udp->rL;
+	int rL_ref = udp->rL_ref;
+	udp->rL = NULL;
+	if (udp->wait_batch) {
+		udp_push_batch(udp, rL, udp->wait_batch);
+		owner_wakeup(udp->loop, &udp->r_owner, rL, 1);
+	} else {
+		udp_push_packet(udp, rL);
+		owner_wakeup(udp->loop, &udp->r_owner, rL, 3);
+	}
+	luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+}
+
+static void udp_buf_alloc(uv_handle_t* handle, size_t size, uv_buf_t *b) {
+	pulsar_udp *udp = (pulsar_udp *)handle->data;
+	b->base = udp->recv_buf;
+	b->len = udp->recv_buflen;
+}
+
+/*
+** Datagrams are copied out of the receive buffer into pooled slabs. With recvmmsg a whole
+** batch arrives as chunks of the same buffer and the waiting coroutine is only resumed once
+** the batch is done
+*/
+static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+	pulsar_udp *udp = (pulsar_udp *)handle->data;
+	if (udp->closed) return;
+
+	if ((nread > 0) || ((nread == 0) && addr)) {
+		udp->received++;
+		if (udp->nb >= udp->max) udp->dropped++;
+		else {
+			size_t size;
+			pulsar_udp_packet *p = (pulsar_udp_packet*)buffer_pool_get(&udp->loop->pool, sizeof(pulsar_udp_packet) + nread, &size);
+			p->next = NULL;
+			p->size = size;
+			p->len = nread;
+			memcpy(&p->addr, addr, (addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+			memcpy(p->data, buf->base, nread);
+			if (udp->tail) udp->tail->next = p;
+			else udp->head = p;
+			udp->tail = p;
+			udp->nb++;
+		}
+	}
+
+#ifdef PULSAR_UDP_MMSG
+	if (flags & UV_UDP_MMSG_CHUNK) return;
+#endif
+	udp_read_resume(udp);
+}
+
+static void udp_send_cb(uv_udp_send_t *_req, int status) {
+	pulsar_udp_send *req = (pulsar_udp_send*)_req;
+	if (req->buffer) req->buffer->pins--;
+	luaL_unref(req->L, LUA_REGISTRYINDEX, req->data_ref);
+	luaL_unref(req->L, LUA_REGISTRYINDEX, req->L_ref);
+	free(req);
+}
+
+/*
+** Sends the string or buffer at idx, written right away when the socket allows it,
+** otherwise queued with the data referenced until it went out
+*/
+static const char *udp_send(pulsar_udp *udp, lua_State *L, const char *host, int port, int idx) {
+	struct sockaddr_storage addr;
+	if (addr_parse(host, port, &addr)) return "invalid address";
+
+	pulsar_buffer *buffer = pulsar_tobuffer(L, idx);
+	uv_buf_t buf;
+	if (buffer) buf = uv_buf_init(buffer->data, buffer->len);
+	else if (lua_isstring(L, idx)) {
+		size_t len;
+		const char *data = lua_tolstring(L, idx, &len);
+		buf = uv_buf_init((char*)data, len);
+	}
+	else return "data is not a string or a buffer";
+
+#ifdef PULSAR_UDP_MMSG
+	int ret = uv_udp_try_send(udp->sock, &buf, 1, (const struct sockaddr*)&addr);
+	if (ret >= 0) return NULL;
+	if (ret != UV_EAGAIN) return "send failed";
+#endif
+
+	pulsar_udp_send *req = (pulsar_udp_send*)malloc(sizeof(pulsar_udp_send));
+	req->buffer = buffer;
+	if (buffer) buffer->pins++;
+	lua_pushthread(L); req->L = L; req->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, idx); req->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (uv_udp_send((uv_udp_send_t*)req, udp->sock, &buf, 1, (const struct sockaddr*)&addr, udp_send_cb)) {
+		udp_send_cb((uv_udp_send_t*)req, -1);
+		return "send failed";
+	}
+	return NULL;
+}
+
+static int pulsar_udp_send_to(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	const char *host = luaL_checkstring(L, 2);
+	int port = luaL_checknumber(L, 3);
+	if (udp->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "closed");
+		return 2;
+	}
+	const char *err = udp_send(udp, L, host, port, 4);
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Sends a list of {data, host, port}, returns how many were sent and the first error
+static int pulsar_udp_send_batch(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (udp->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "closed");
+		return 2;
+	}
+
+	int i, n = lua_objlen(L, 2), sent = 0;
+	const char *first_err = NULL;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			if (!first_err) first_err = "datagram is not a table";
+			continue;
+		}
+		int top = lua_gettop(L);
+		lua_rawgeti(L, top, 1);
+		lua_rawgeti(L, top, 2);
+		lua_rawgeti(L, top, 3);
+		const char *err = "datagram needs data, host and port";
+		if (lua_isstring(L, top + 2) && lua_isnumber(L, top + 3))
+			err = udp_send(udp, L, lua_tostring(L, top + 2), lua_tonumber(L, top + 3), top + 1);
+		if (err) { if (!first_err) first_err = err; }
+		else sent++;
+		lua_settop(L, top - 1);
+	}
+
+	lua_pushnumber(L, sent);
+	if (!first_err) return 1;
+	lua_pushstring(L, first_err);
+	return 2;
+}
+
+static int udp_read_wait(pulsar_udp *udp, lua_State *L, int batch) {
+	if (udp->closed) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "closed");
+		return 2;
+	}
+	if (udp->rL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "already receiving");
+		return 2;
+	}
+	lua_pushthread(L); udp->rL = lua_tothread(L, -1); udp->rL_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	udp->r_owner = loop_owner(udp->loop, L);
+	udp->wait_batch = batch;
+	return lua_yield(L, 0);
+}
+
+static int pulsar_udp_recv(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	if (udp->head) {
+		udp_push_packet(udp, L);
+		return 3;
+	}
+	return udp_read_wait(udp, L, 0);
+}
+
+static int pulsar_udp_recv_batch(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	int max = luaL_optnumber(L, 2, PULSAR_UDP_BATCH);
+	if (max < 1) max = 1;
+	if (udp->head) {
+		udp_push_batch(udp, L, max);
+		return 1;
+	}
+	return udp_read_wait(udp, L, max);
+}
+
+static int pulsar_udp_stats(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	lua_newtable(L);
+	lua_pushnumber(L, udp->nb); lua_setfield(L, -2, "queued");
+	lua_pushnumber(L, udp->max); lua_setfield(L, -2, "max");
+	lua_pushnumber(L, udp->received); lua_setfield(L, -2, "received");
+	lua_pushnumber(L, udp->dropped); lua_setfield(L, -2, "dropped");
+	lua_pushboolean(L, udp->mmsg); lua_setfield(L, -2, "recvmmsg");
+	return 1;
+}
+
+static int pulsar_udp_getsockname(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	if (udp->closed) return 0;
+	struct sockaddr_storage addr;
+	int addrlen = sizeof(addr);
+	if (uv_udp_getsockname(udp->sock, (struct sockaddr*)&addr, &addrlen)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "getsockname failed");
+		return 2;
+	}
+	push_sockaddr(L, (const struct sockaddr*)&addr);
+	return 2;
+}
+
+static int pulsar_udp_close(lua_State *L) {
+	pulsar_udp *udp = (pulsar_udp *)luaL_checkudata (L, 1, MT_PULSAR_UDP);
+	if (udp->closed) return 0;
+	udp->closed = true;
+	uv_udp_recv_stop(udp->sock);
+	uv_close((uv_handle_t*)udp->sock, close_cb);
+	while (udp->head) udp_packet_free(udp, udp_packet_shift(udp));
+	free(udp->recv_buf);
+	udp->recv_buf = NULL;
+
+	if (udp->rL) {
+		lua_State *rL = udp->rL;
+		int rL_ref = udp->rL_ref;
+		udp->rL = NULL;
+		lua_pushnil(rL);
+		lua_pushliteral(rL, "closed");
+		owner_wakeup(udp->loop, &udp->r_owner, rL, 2);
+		luaL_unref(rL, LUA_REGISTRYINDEX, rL_ref);
+	}
+	return 0;
+}
+
+static int pulsar_udp_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	const char *address = luaL_checkstring(L, 2);
+	int port = luaL_checknumber(L, 3);
+
+	int batch = PULSAR_UDP_BATCH, max = PULSAR_UDP_QUEUE;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "batch");
+		if (lua_isnumber(L, -1)) batch = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 4, "queue");
+		if (lua_isnumber(L, -1)) max = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	if (max < 1) max = 1;
+
+	struct sockaddr_storage bind_addr;
+	if (addr_parse(address, port, &bind_addr)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "invalid address");
+		return 2;
+	}
+
+	uv_udp_t *sock = (uv_udp_t*)malloc(sizeof(uv_udp_t));
+	bool mmsg = false;
+#ifdef PULSAR_UDP_MMSG
+	if (batch > 1) {
+		uv_udp_init_ex(loop->loop, sock, AF_UNSPEC | UV_UDP_RECVMMSG);
+		mmsg = true;
+	}
+	else uv_udp_init(loop->loop, sock);
+#else
+	uv_udp_init(loop->loop, sock);
+#endif
+	if (uv_udp_bind(sock, (const struct sockaddr*)&bind_addr, 0)) {
+		uv_close((uv_handle_t*)sock, close_cb);
+		lua_pushnil(L);
+		lua_pushliteral(L, "could not bind");
+		return 2;
+	}
+
+	pulsar_udp *udp = (pulsar_udp*)lua_newuserdata(L, sizeof(pulsar_udp));
+	pulsar_setmeta(L, MT_PULSAR_UDP);
+	udp->sock = sock;
+	udp->sock->data = udp;
+	udp->loop = loop;
+	udp->closed = false;
+	udp->mmsg = mmsg;
+	udp->recv_buflen = mmsg ? PULSAR_UDP_DGRAM_MAX * batch : PULSAR_UDP_DGRAM_MAX;
+	udp->recv_buf = malloc(udp->recv_buflen);
+	udp->head = udp->tail = NULL;
+	udp->nb = 0;
+	udp->max = max;
+	udp->received = 0;
+	udp->dropped = 0;
+	udp->rL = NULL;
+	udp->rL_ref = LUA_NOREF;
+	udp->wait_batch = 0;
+	uv_udp_recv_start(sock, udp_buf_alloc, udp_recv_cb);
+	return 1;
+}
+
+/**************************************************************************************
+ ** Timers
+ **************************************************************************************/
+static void pulsar_timer_resume(pulsar_timer *timer, lua_State *L, int nargs) {
+	int ret = loop_resume(timer->loop, PULSAR_RESUME_TIMER, timer, L, nargs);
+	if (ret == LUA_YIELD) return;
+
+	// Finished, the timer is done
+	if (!ret) {
+		wheel_remove(&timer->loop->wheel, &timer->node);
+		timer->active = false;
+		pulsar_co_release(timer->loop, L, timer->co_ref);
+		timer->L = NULL;
+		timer->co_ref = LUA_NOREF;
+		return;
+	}
+
+	if (ret == LUA_ERRRUN) {
+		printf("Error while running timer's coroutine: %s\n", lua_tostring(L, -1));
+		traceback(L);
+
+		wheel_remove(&timer->loop->wheel, &timer->node);
+		timer->active = false;
+		luaL_unref(L, LUA_REGISTRYINDEX, timer->co_ref);
+		timer->L = NULL;
+		timer->co_ref = LUA_NOREF;
+		return;
+	}
+}
+
+static void timer_run(void *data, lua_State *L, int nargs) {
+	pulsar_timer *timer = (pulsar_timer *)data;
+	timer->queued = false;
+	if (!timer->L) return;
+	if (timer->first_run) {
+		timer->first_run = false;
+		pulsar_timer_resume(timer, timer->L, 1);
+	} else {
+		pulsar_timer_resume(timer, timer->L, 0);
+	}
+}
+
+// A wait of the timer's coroutine ended, unless the timer was closed meanwhile
+static void timer_wait_cb(void *data, lua_State *L, int nargs) {
+	pulsar_timer *timer = (pulsar_timer *)data;
+	if (timer->L == L) pulsar_timer_resume(timer, L, nargs);
+	else co_task_cb(timer->loop, L, nargs);
+}
+
+static void timer_cb(pulsar_wheel_node *node) {
+	pulsar_timer *timer = (pulsar_timer *)node->data;
+	timer->active = false;
+	timer->loop->metrics.timer_fires++;
+	if (!timer->L || timer->queued) return;
+	timer->queued = true;
+	sched_wakeup(timer->loop, PULSAR_CLASS_NORMAL, timer_run, timer, NULL, 0);
+}
+
+static int pulsar_timer_close(lua_State *L) {
+	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
+	wheel_remove(&timer->loop->wheel, &timer->node);
+	sched_cancel(timer->loop, timer);
+	timer->queued = false;
+	timer->active = false;
+	luaL_unref(L, LUA_REGISTRYINDEX, timer->co_ref);
+	timer->L = NULL;
+	timer->co_ref = LUA_NOREF;
+	return 0;
+}
+static int pulsar_timer_start(lua_State *L) {
+	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
+	wheel_add(&timer->loop->wheel, &timer->node, timer->timeout);
+	timer->active = true;
+	return 0;
+}
+static int pulsar_timer_stop(lua_State *L) {
+	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
+	wheel_remove(&timer->loop->wheel, &timer->node);
+	timer->active = false;
+	return 0;
+}
+static int pulsar_timer_next(lua_State *L) {
+	pulsar_timer *timer = (pulsar_timer *)luaL_checkudata (L, 1, MT_PULSAR_TIMER);
+	// Like uv_timer_again, a timer without repeat does not fire again
+	if (timer->repeat) {
+		wheel_add(&timer->loop->wheel, &timer->node, timer->repeat);
+		timer->active = true;
+	}
+	return lua_yield(L, 0);
+}
+
+static int pulsar_timer_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	double first = luaL_checknumber(L, 2);
+	double repeat = luaL_checknumber(L, 3);
+	if (!lua_isfunction(L, 4)) { lua_pushstring(L, "argument 3 is not a function"); lua_error(L); return 0; }
+
+	// Initialize and start a watcher to accepts client requests
+	pulsar_timer *timer = (pulsar_timer*)lua_newuserdata(L, sizeof(pulsar_timer));
+	pulsar_setmeta(L, MT_PULSAR_TIMER);
+	timer->loop = loop;
+	timer->active = false;
+	timer->first_run = true;
+	timer->queued = false;
+
+	timer->L = pulsar_co_acquire(loop, L, &timer->co_ref);
+	lua_pushvalue(L, 4);
+	lua_pushvalue(L, 5);
+	lua_xmove(L, timer->L, 2);
+	timer->timeout = wheel_ms(first);
+	timer->repeat = wheel_ms(repeat);
+
+	wheel_node_init(&timer->node, timer_cb, timer);
+	return 1;
+}
+
+/**************************************************************************************
+ ** Idles
+ **************************************************************************************/
+// Reads the interval field, in ms, of the options table at idx, 0 to spin on an idle handle
+static uint64_t sched_interval_read(lua_State *L, int idx) {
+	uint64_t interval = 0;
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "interval");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) > 0)) {
+			interval = lua_tonumber(L, -1);
+			if (!interval) interval = 1;
+		}
+		lua_pop(L, 1);
+	}
+	return interval;
+}
+
+static void idle_check_cb(uv_check_t *_watcher, int status);
+static void idle_wake_cb(pulsar_wheel_node *node);
+static void idle_cb(uv_idle_t *_watcher, int status);
+
+static void idle_sched_start(pulsar_idle *idle) {
+	if (idle->interval) {
+		uv_check_start(idle->w_check, idle_check_cb);
+		if (!idle->wake.active) wheel_add(&idle->loop->wheel, &idle->wake, idle->interval);
+	}
+	else uv_idle_start(idle->w_timeout, idle_cb);
+	idle->active = true;
+}
+
+static void idle_sched_stop(pulsar_idle *idle) {
+	uv_idle_stop(idle->w_timeout);
+	uv_check_stop(idle->w_check);
+	wheel_remove(&idle->loop->wheel, &idle->wake);
+	idle->active = false;
+}
+
+static void pulsar_idle_resume(pulsar_idle *idle, lua_State *L, int nargs) {
+	int ret = loop_resume(idle->loop, PULSAR_RESUME_IDLE, idle, L, nargs);
+	// More to do
+	if (ret == LUA_YIELD) return;
+
+	// Finished, end the idle
+	if (!ret) {
+		idle_sched_stop(idle);
+		pulsar_co_release(idle->loop, L, idle->co_ref);
+		idle->L = NULL;
+		idle->co_ref = LUA_NOREF;
+		return;
+	}
+
+	if (ret == LUA_ERRRUN) {
+		printf("Error while running idle's coroutine: %s\n", lua_tostring(L, -1));
+		traceback(L);
+
+		idle_sched_stop(idle);
+		luaL_unref(L, LUA_REGISTRYINDEX, idle->co_ref);
+		idle->L = NULL;
+		idle->co_ref = LUA_NOREF;
+		return;
+	}
+}
+
+static void idle_wait_cb(void *data, lua_State *L, int nargs) {
+	pulsar_idle *idle = (pulsar_idle *)data;
+	if (idle->L == L) pulsar_idle_resume(idle, L, nargs);
+	else co_task_cb(idle->loop, L, nargs);
+}
+
+static void idle_run(pulsar_idle *idle) {
+	if (!idle->L) {
+		idle_sched_stop(idle);
+		return;
+	}
+
+	if (idle->first_run) {
+		idle->first_run = false;
+		pulsar_idle_resume(idle, idle->L, 1);
+	} else {
+		pulsar_idle_resume(idle, idle->L, 0);
+	}
+}
+
+static void idle_task_cb(void *data, lua_State *L, int nargs) {
+	pulsar_idle *idle = (pulsar_idle *)data;
+	idle->queued = false;
+	idle_run(idle);
+}
+
+static void idle_wakeup(pulsar_idle *idle) {
+	if (idle->queued) return;
+	idle->queued = true;
+	sched_wakeup(idle->loop, PULSAR_CLASS_BULK, idle_task_cb, idle, NULL, 0);
+}
+
+static void idle_cb(uv_idle_t *_watcher, int status) {
+	idle_wakeup((pulsar_idle *)_watcher->data);
+}
+
+static void idle_check_cb(uv_check_t *_watcher, int status) {
+	idle_wakeup((pulsar_idle *)_watcher->data);
+}
+
+// Keeps the loop from blocking longer than the interval while the idle is active
+static void idle_wake_cb(pulsar_wheel_node *node) {
+	pulsar_idle *idle = (pulsar_idle *)node->data;
+	idle_wakeup(idle);
+	if (idle->active) wheel_add(&idle->loop->wheel, &idle->wake, idle->interval);
+}
+
+static int pulsar_idle_close(lua_State *L) {
+	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
+	if (!idle->w_timeout) return 0;
+	idle_sched_stop(idle);
+	sched_cancel(idle->loop, idle);
+	idle->queued = false;
+	uv_close((uv_handle_t*)idle->w_timeout, close_cb);
+	uv_close((uv_handle_t*)idle->w_check, close_cb);
+	idle->w_timeout = NULL;
+	idle->w_check = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, idle->co_ref);
+	idle->L = NULL;
+	idle->co_ref = LUA_NOREF;
+	return 0;
+}
+static int pulsar_idle_start(lua_State *L) {
+	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
+	if (idle->w_timeout) idle_sched_start(idle);
+	return 0;
+}
+static int pulsar_idle_stop(lua_State *L) {
+	pulsar_idle *idle = (pulsar_idle *)luaL_checkudata (L, 1, MT_PULSAR_IDLE);
+	if (idle->w_timeout) idle_sched_stop(idle);
+	return 0;
+}
+static int pulsar_idle_next(lua_State *L) {
+	return lua_yield(L, 0);
+}
+
+static int pulsar_idle_new(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	if (!lua_isfunction(L, 2)) { lua_pushstring(L, "argument 1 is not a function"); lua_error(L); return 0; }
+
+	// Initialize and start a watcher to accepts client requests
+	uint64_t interval = sched_interval_read(L, 3);
+	pulsar_idle *idle = (pulsar_idle*)lua_newuserdata(L, sizeof(pulsar_idle));
+	int idx = lua_gettop(L);
+	pulsar_setmeta(L, MT_PULSAR_IDLE);
+	idle->loop = loop;
+	idle->active = false;
+	idle->first_run = true;
+	idle->queued = false;
+
+	idle->L = pulsar_co_acquire(loop, L, &idle->co_ref);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, idx);
+	lua_xmove(L, idle->L, 2);
+
+	idle->w_timeout = (uv_idle_t*)malloc(sizeof(uv_idle_t));
+	idle->w_timeout->data = idle;
+	uv_idle_init(loop->loop, idle->w_timeout);
+	idle->w_check = (uv_check_t*)malloc(sizeof(uv_check_t));
+	idle->w_check->data = idle;
+	uv_check_init(loop->loop, idle->w_check);
+	idle->interval = interval;
+	wheel_node_init(&idle->wake, idle_wake_cb, idle);
+	return 1;
+}
+
+/**************************************************************************************
+ ** Idle Workers
+ **************************************************************************************/
+static void idle_worker_check_cb(uv_check_t *_watcher, int status);
+static void idle_worker_cb(uv_idle_t *_watcher, int status);
+
+static void idle_worker_sched_start(pulsar_idle_worker *idle_worker) {
+	if (idle_worker->interval) {
+		uv_check_start(idle_worker->w_check, idle_worker_check_cb);
+		if (!idle_worker->wake.active) wheel_add(&idle_worker->loop->wheel, &idle_worker->wake, idle_worker->interval);
+	}
+	else uv_idle_start(idle_worker->w_timeout, idle_worker_cb);
+	idle_worker->active = true;
+}
+
+static void idle_worker_sched_stop(pulsar_idle_worker *idle_worker) {
+	uv_idle_stop(idle_worker->w_timeout);
+	uv_check_stop(idle_worker->w_check);
+	wheel_remove(&idle_worker->loop->wheel, &idle_worker->wake);
+	idle_worker->active = false;
+}
+
+static int pulsar_idle_worker_resume(pulsar_idle_worker *idle_worker, pulsar_idle_worker_chain *task, lua_State *L, int nargs) {
+	int ret = loop_resume(idle_worker->loop, PULSAR_RESUME_WORKER, task, L, nargs);
+	// More to do
+	if (ret == LUA_YIELD) return ret;
+
+	// Finished, end the idle_worker
+	if (!ret) {
+		if (!idle_worker->chain) idle_worker_sched_stop(idle_worker);
+		return ret;
+	}
+
+	if (ret == LUA_ERRRUN) {
+		printf("Error while running idle_worker's coroutine: %s\n", lua_tostring(L, -1));
+		traceback(L);
+
+		if (!idle_worker->chain) idle_worker_sched_stop(idle_worker);
+		return ret;
+	}
+	return ret;
+}
+
+static pulsar_idle_worker_chain *idle_worker_chain_new(pulsar_idle_worker *idle_worker) {
+	pulsar_idle_worker_chain *chain = idle_worker->free_chain;
+	if (chain) {
+		idle_worker->free_chain = chain->next;
+		idle_worker->nb_free--;
+	}
+	else chain = malloc(sizeof(pulsar_idle_worker_chain));
+	chain->worker = idle_worker;
+	chain->held = false;
+	chain->next = NULL;
+	return chain;
+}
+
+static void idle_worker_chain_free(pulsar_idle_worker *idle_worker, pulsar_idle_worker_chain *chain) {
+	if (idle_worker->nb_free >= PULSAR_WORKER_POOL_MAX) { free(chain); return; }
+	chain->next = idle_worker->free_chain;
+	idle_worker->free_chain = chain;
+	idle_worker->nb_free++;
+}
+
+/*
+** Resumes queued tasks until the budget is spent, at least one runs each time
+*/
+static void idle_worker_run(pulsar_idle_worker *idle_worker) {
+	uint64_t start = uv_hrtime();
+	do {
+		if (!idle_worker->chain) {
+			idle_worker_sched_stop(idle_worker);
+			return;
+		}
+
+		pulsar_idle_worker_chain *chain = idle_worker->chain;
+		idle_worker->chain = chain->next;
+		if (!idle_worker->chain) idle_worker->chain_tail = NULL;
+		idle_worker->loop->metrics.worker_queued--;
+		lua_State *rL = chain->L;
+		chain->held = false;
+
+		idle_worker->current = chain;
+		idle_worker->slice_start = uv_hrtime();
+		int ret = pulsar_idle_worker_resume(idle_worker, chain, rL, chain->nargs);
+		idle_worker->current = NULL;
+		// Split or waiting, the task comes back through the queue with its record
+		if ((ret == LUA_YIELD) && chain->held) continue;
+
+		// Registered functions run in pooled coroutines, give them back once done
+		if (chain->owned && (ret != LUA_YIELD)) pulsar_co_release(idle_worker->loop, rL, chain->L_ref);
+		else luaL_unref(rL, LUA_REGISTRYINDEX, chain->L_ref);
+		idle_worker_chain_free(idle_worker, chain);
+	} while (idle_worker->active && (uv_hrtime() - start < idle_worker->budget));
+}
+
+static void idle_worker_task_cb(void *data, lua_State *L, int nargs) {
+	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)data;
+	idle_worker->queued = false;
+	idle_worker_run(idle_worker);
+}
+
+static void idle_worker_wakeup(pulsar_idle_worker *idle_worker) {
+	if (idle_worker->queued) return;
+	idle_worker->queued = true;
+	sched_wakeup(idle_worker->loop, PULSAR_CLASS_BULK, idle_worker_task_cb, idle_worker, NULL, 0);
+}
+
+static void idle_worker_cb(uv_idle_t *_watcher, int status) {
+	idle_worker_wakeup((pulsar_idle_worker *)_watcher->data);
+}
+
+static void idle_worker_check_cb(uv_check_t *_watcher, int status) {
+	idle_worker_wakeup((pulsar_idle_worker *)_watcher->data);
+}
+
+static void idle_worker_wake_cb(pulsar_wheel_node *node) {
+	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)node->data;
+	idle_worker_wakeup(idle_worker);
+	if (idle_worker->active) wheel_add(&idle_worker->loop->wheel, &idle_worker->wake, idle_worker->interval);
+}
+
+static void idle_worker_push(pulsar_idle_worker *idle_worker, pulsar_idle_worker_chain *chain) {
+	if (!idle_worker->chain) idle_worker->chain = chain;
+	else idle_worker->chain_tail->next = chain;
+	idle_worker->chain_tail = chain;
+	idle_worker->loop->metrics.worker_queued++;
+
+	if (!idle_worker->active) idle_worker_sched_start(idle_worker);
+}
+
+/*
+** Ends a wait through the path of the coroutine's owner, so that once it returns or fails it is
+** released or closed like after any other resume. A worker's task goes back in its queue
+*/
+static void owner_wakeup(pulsar_loop *loop, pulsar_owner *owner, lua_State *L, int nargs) {
+	switch (owner->kind) {
+		case PULSAR_RESUME_CLIENT:
+			pulsar_client_resume((pulsar_tcp_client *)owner->ptr, L, nargs);
+			return;
+		case PULSAR_RESUME_TIMER:
+			sched_wakeup(loop, PULSAR_CLASS_NORMAL, timer_wait_cb, owner->ptr, L, nargs);
+			return;
+		case PULSAR_RESUME_IDLE:
+			sched_wakeup(loop, PULSAR_CLASS_NORMAL, idle_wait_cb, owner->ptr, L, nargs);
+			return;
+		case PULSAR_RESUME_WORKER: {
+			pulsar_idle_worker_chain *chain = (pulsar_idle_worker_chain *)owner->ptr;
+			pulsar_idle_worker *idle_worker = chain->worker;
+			if (idle_worker->w_timeout) {
+				chain->nargs = nargs;
+				chain->next = NULL;
+				idle_worker_push(idle_worker, chain);
+				return;
+			}
+			// The worker was closed meanwhile, the coroutine goes on as a plain task
+			luaL_unref(L, LUA_REGISTRYINDEX, chain->L_ref);
+			free(chain);
+			break;
+		}
+	}
+	sched_wakeup(loop, PULSAR_CLASS_NORMAL, co_task_cb, loop, L, nargs);
+}
+
+static int pulsar_idle_worker_close(lua_State *L) {
+	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)luaL_checkudata (L, 1, MT_PULSAR_IDLE_WORKER);
+	if (!idle_worker->w_timeout) return 0;
+	idle_worker_sched_stop(idle_worker);
+	sched_cancel(idle_worker->loop, idle_worker);
+	idle_worker->queued = false;
+	while (idle_worker->chain) {
+		pulsar_idle_worker_chain *chain = idle_worker->chain;
+		idle_worker->chain = idle_worker->chain->next;
+		idle_worker->loop->metrics.worker_queued--;
 
 		luaL_unref(L, LUA_REGISTRYINDEX, chain->L_ref);
 		free(chain);
 	}
+	idle_worker->chain_tail = NULL;
+	while (idle_worker->free_chain) {
+		pulsar_idle_worker_chain *chain = idle_worker->free_chain;
+		idle_worker->free_chain = chain->next;
+		free(chain);
+	}
+	idle_worker->nb_free = 0;
 	uv_close((uv_handle_t*)idle_worker->w_timeout, close_cb);
+	uv_close((uv_handle_t*)idle_worker->w_check, close_cb);
+	idle_worker->w_timeout = NULL;
+	idle_worker->w_check = NULL;
 	return 0;
 }
 
+/*
+** With a budget in ms, a task the worker is running only yields once it ran for that long
+*/
 static int pulsar_idle_worker_split(lua_State *L) {
 	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)luaL_checkudata (L, 1, MT_PULSAR_IDLE_WORKER);
-	uv_idle_start(idle_worker->w_timeout, idle_worker_cb);
-	idle_worker->active = true;
+	if (!idle_worker->w_timeout) { lua_pushstring(L, "worker is closed"); lua_error(L); return 0; }
+	pulsar_idle_worker_chain *current = idle_worker->current;
+	if (current && (L != current->L)) current = NULL;
+	if (lua_isnumber(L, 2) && current) {
+		uint64_t slice = lua_tonumber(L, 2) * 1000000;
+		if (uv_hrtime() - idle_worker->slice_start < slice) return 0;
+	}
+
+	// The running task goes back in the queue as it is, still owning its pooled coroutine
+	if (current) {
+		current->held = true;
+		current->nargs = 0;
+		current->next = NULL;
+		idle_worker_push(idle_worker, current);
+		return lua_yield(L, 0);
+	}
 
-	pulsar_idle_worker_chain *chain = malloc(sizeof(pulsar_idle_worker_chain));
+	pulsar_idle_worker_chain *chain = idle_worker_chain_new(idle_worker);
 	lua_pushthread(L); chain->L = lua_tothread(L, -1); chain->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	chain->nargs = 0;
-	chain->next = NULL;
-
-	if (!idle_worker->chain) idle_worker->chain = chain;
-	else {
-		pulsar_idle_worker_chain *tail = idle_worker->chain;
-		while (tail->next) tail = tail->next;
-		tail->next = chain;
-	}
+	chain->owned = false;
+	idle_worker_push(idle_worker, chain);
 
 	return lua_yield(L, 0);
 }
@@ -789,29 +4081,25 @@ static int pulsar_idle_worker_split(lua_State *L) {
 static int pulsar_idle_worker_register(lua_State *L) {
 	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)luaL_checkudata (L, 1, MT_PULSAR_IDLE_WORKER);
 	if (!lua_isfunction(L, 2)) { lua_pushstring(L, "argument 1 is not a function"); lua_error(L); return 0; }
+	if (!idle_worker->w_timeout) { lua_pushstring(L, "worker is closed"); lua_error(L); return 0; }
 
-	uv_idle_start(idle_worker->w_timeout, idle_worker_cb);
-	idle_worker->active = true;
-
-	pulsar_idle_worker_chain *chain = malloc(sizeof(pulsar_idle_worker_chain));
-	chain->L = lua_newthread(L);
-	chain->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	pulsar_idle_worker_chain *chain = idle_worker_chain_new(idle_worker);
+	chain->L = pulsar_co_acquire(idle_worker->loop, L, &chain->L_ref);
 	chain->nargs = 0;
-	lua_atpanic(chain->L, pulsar_panic);
+	chain->owned = true;
 	lua_pushvalue(L, 2);
 	lua_xmove(L, chain->L, 1);
-
-	chain->next = NULL;
-
-	if (!idle_worker->chain) idle_worker->chain = chain;
-	else {
-		pulsar_idle_worker_chain *tail = idle_worker->chain;
-		while (tail->next) tail = tail->next;
-		tail->next = chain;
-	}
+	idle_worker_push(idle_worker, chain);
 	return 0;
 }
 
+static int pulsar_idle_worker_budget(lua_State *L) {
+	pulsar_idle_worker *idle_worker = (pulsar_idle_worker *)luaL_checkudata (L, 1, MT_PULSAR_IDLE_WORKER);
+	if (lua_isnumber(L, 2)) idle_worker->budget = lua_tonumber(L, 2) * 1000000;
+	lua_pushnumber(L, idle_worker->budget / 1000000.0);
+	return 1;
+}
+
 static int pulsar_idle_worker_new(lua_State *L)
 {
 	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
@@ -821,209 +4109,856 @@ static int pulsar_idle_worker_new(lua_State *L)
 	pulsar_setmeta(L, MT_PULSAR_IDLE_WORKER);
 	idle->loop = loop;
 	idle->active = false;
+	idle->queued = false;
 	idle->chain = NULL;
+	idle->chain_tail = NULL;
+	idle->free_chain = NULL;
+	idle->nb_free = 0;
+	idle->budget = (lua_isnumber(L, 2) ? lua_tonumber(L, 2) : PULSAR_WORKER_BUDGET) * 1000000;
+	idle->current = NULL;
+	idle->slice_start = 0;
+
+	idle->w_timeout = (uv_idle_t*)malloc(sizeof(uv_idle_t));
+	idle->w_timeout->data = idle;
+	uv_idle_init(loop->loop, idle->w_timeout);
+	idle->w_check = (uv_check_t*)malloc(sizeof(uv_check_t));
+	idle->w_check->data = idle;
+	uv_check_init(loop->loop, idle->w_check);
+	idle->interval = sched_interval_read(L, 3);
+	wheel_node_init(&idle->wake, idle_worker_wake_cb, idle);
+	return 1;
+}
+
+
+/**************************************************************************************
+ ** Spawns
+ **************************************************************************************/
+
+static void writeTblFixed(pulsar_spawn_ret *s, const char *data, long len) {
+	if (len + s->bufpos + 1 >= s->buflen) {
+		size_t size = s->buflen ? s->buflen : 32;
+		while (len + s->bufpos + 1 >= size) size *= 2;
+		s->buf = realloc(s->buf, size * sizeof(char));
+		s->buflen = size;
+	}
+	memcpy(s->buf + s->bufpos, data, len);
+	s->bufpos += len;
+}
+
+static int spawn_dump(lua_State *L, const void* p, size_t sz, void* ud)
+{
+	writeTblFixed((pulsar_spawn_ret*)ud, p, sz);
+	return 0;
+}
+
+/*
+** Values passed to and from spawns are encoded as a tag byte followed by:
+** - integers: a zigzag varint
+** - doubles: the 8 raw bytes
+** - strings & functions: a varint length and the raw bytes (bytecode for functions)
+** - tables: array and hash size hints, key/value pairs and an end tag
+** - a table already seen: a varint reference to it, so shared & cyclic tables keep their shape
+** - buffers: their memory pointer, length and capacity when moved to a spawn, or as strings
+*/
+#define SER_NIL			0
+#define SER_FALSE		1
+#define SER_TRUE		2
+#define SER_INT			3
+#define SER_DOUBLE		4
+#define SER_STRING		5
+#define SER_FUNCTION		6
+#define SER_TABLE		7
+#define SER_TABLE_END		8
+#define SER_REF			9
+#define SER_BUFFER		10
+#define SER_MAX_DEPTH		200
+#define SER_INT_MAX		9007199254740992.0
+
+static void ser_write_tag(pulsar_spawn_ret *s, char tag) {
+	writeTblFixed(s, &tag, 1);
+}
+
+static void ser_write_varint(pulsar_spawn_ret *s, uint64_t v) {
+	char tmp[10];
+	int l = 0;
+	while (v >= 0x80) { tmp[l++] = (v & 0x7f) | 0x80; v >>= 7; }
+	tmp[l++] = v;
+	writeTblFixed(s, tmp, l);
+}
+
+static bool ser_supported(lua_State *L, int idx) {
+	int type = lua_type(L, idx);
+	return (type == LUA_TBOOLEAN) || (type == LUA_TNUMBER) || (type == LUA_TSTRING) || (type == LUA_TFUNCTION) || (type == LUA_TTABLE) || pulsar_tobuffer(L, idx);
+}
+
+/*
+** Tables and transfered buffers already sent are written as a reference, returns true if it was
+*/
+static bool ser_encode_ref(lua_State *L, pulsar_encoder *e, int idx) {
+	lua_pushvalue(L, idx);
+	lua_rawget(L, e->seen);
+	if (!lua_isnil(L, -1)) {
+		ser_write_tag(e->out, SER_REF);
+		ser_write_varint(e->out, lua_tointeger(L, -1));
+		lua_pop(L, 1);
+		return true;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, ++e->ntables);
+	lua_rawset(L, e->seen);
+	return false;
+}
+
+static void ser_encode(lua_State *L, pulsar_encoder *e, int idx, int depth)
+{
+	pulsar_spawn_ret *s = e->out;
+	pulsar_buffer *b;
+	int type = lua_type(L, idx);
+	if (type == LUA_TNIL) {
+		ser_write_tag(s, SER_NIL);
+	} else if (type == LUA_TBOOLEAN) {
+		ser_write_tag(s, lua_toboolean(L, idx) ? SER_TRUE : SER_FALSE);
+	} else if (type == LUA_TNUMBER) {
+		lua_Number n = lua_tonumber(L, idx);
+		if ((n >= -SER_INT_MAX) && (n <= SER_INT_MAX) && ((lua_Number)(int64_t)n == n) && !(n == 0 && signbit(n))) {
+			int64_t i = (int64_t)n;
+			ser_write_tag(s, SER_INT);
+			ser_write_varint(s, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+		} else {
+			double d = n;
+			ser_write_tag(s, SER_DOUBLE);
+			writeTblFixed(s, (const char*)&d, sizeof(double));
+		}
+	} else if (type == LUA_TSTRING) {
+		size_t len;
+		const char *str = lua_tolstring(L, idx, &len);
+		ser_write_tag(s, SER_STRING);
+		ser_write_varint(s, len);
+		writeTblFixed(s, str, len);
+	} else if (type == LUA_TFUNCTION) {
+		if (lua_iscfunction(L, idx)) {
+			printf("*WARNING* can not pass to/from spawn a C function\n");
+			ser_write_tag(s, SER_NIL);
+			return;
+		}
+		pulsar_spawn_ret dump = { NULL, 0, 0, 0 };
+		lua_pushvalue(L, idx);
+		lua_dump(L, spawn_dump, &dump);
+		lua_pop(L, 1);
+		ser_write_tag(s, SER_FUNCTION);
+		ser_write_varint(s, dump.bufpos);
+		writeTblFixed(s, dump.buf, dump.bufpos);
+		free(dump.buf);
+	} else if (type == LUA_TTABLE) {
+		if (depth >= SER_MAX_DEPTH) {
+			printf("*WARNING* can not pass to/from spawn tables nested more than %d deep\n", SER_MAX_DEPTH);
+			ser_write_tag(s, SER_NIL);
+			return;
+		}
+		luaL_checkstack(L, 4, "table too deep to pass to/from spawn");
+		if (ser_encode_ref(L, e, idx)) return;
+
+		// Size hints are filled once we know them
+		ser_write_tag(s, SER_TABLE);
+		size_t hints = s->bufpos;
+		uint32_t narr = lua_objlen(L, idx), nrec = 0, count = 0;
+		writeTblFixed(s, (const char*)&narr, sizeof(uint32_t));
+		writeTblFixed(s, (const char*)&nrec, sizeof(uint32_t));
+
+		lua_pushnil(L);  /* first key */
+		while (lua_next(L, idx) != 0)
+		{
+			// Only save allowed types
+			int top = lua_gettop(L);
+			if (ser_supported(L, top - 1) && ser_supported(L, top)) {
+				ser_encode(L, e, top - 1, depth + 1);
+				ser_encode(L, e, top, depth + 1);
+				count++;
+			}
+			/* removes 'value'; keeps 'key' for next iteration */
+			lua_pop(L, 1);
+		}
+		ser_write_tag(s, SER_TABLE_END);
+
+		if (narr > count) narr = count;
+		nrec = count - narr;
+		memcpy(s->buf + hints, &narr, sizeof(uint32_t));
+		memcpy(s->buf + hints + sizeof(uint32_t), &nrec, sizeof(uint32_t));
+	} else if ((b = pulsar_tobuffer(L, idx))) {
+		if (!e->transfer) {
+			ser_write_tag(s, SER_STRING);
+			ser_write_varint(s, b->len);
+			writeTblFixed(s, b->data, b->len);
+			return;
+		}
+		if (b->pins) {
+			printf("*WARNING* can not pass to/from spawn a buffer in use by a read or a send\n");
+			ser_write_tag(s, SER_NIL);
+			return;
+		}
+		if (ser_encode_ref(L, e, idx)) return;
+
+		// The memory now belongs to the other side, this buffer is left empty
+		ser_write_tag(s, SER_BUFFER);
+		writeTblFixed(s, (const char*)&b->data, sizeof(char*));
+		writeTblFixed(s, (const char*)&b->len, sizeof(size_t));
+		writeTblFixed(s, (const char*)&b->cap, sizeof(size_t));
+		b->data = NULL;
+		b->len = b->cap = 0;
+	} else {
+		printf("*WARNING* can not pass to/from spawn a value of type %s\n", lua_typename(L, type));
+		ser_write_tag(s, SER_NIL);
+	}
+}
+
+/*
+** Encodes the n values starting at absolute index idx, prefixed by their number
+** When transfer is set buffers are moved instead of copied, only for data decoded in the same process
+*/
+static void pulsar_encode(lua_State *L, pulsar_spawn_ret *s, int idx, int n, bool transfer)
+{
+	int i;
+	lua_newtable(L);
+	pulsar_encoder e = { s, lua_gettop(L), 0, transfer };
+	s->nbrets = n;
+	ser_write_varint(s, n);
+	for (i = 0; i < n; i++) ser_encode(L, &e, idx + i, 0);
+	lua_pop(L, 1);
+}
+
+static bool ser_read_varint(pulsar_decoder *d, uint64_t *v) {
+	uint64_t r = 0;
+	int shift = 0;
+	while ((d->pos < d->len) && (shift < 64)) {
+		unsigned char c = d->buf[d->pos++];
+		r |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) { *v = r; return true; }
+		shift += 7;
+	}
+	return false;
+}
+
+static bool ser_read_fixed(pulsar_decoder *d, void *dest, size_t len) {
+	if (len > d->len - d->pos) return false;
+	memcpy(dest, d->buf + d->pos, len);
+	d->pos += len;
+	return true;
+}
+
+/*
+** Pushes one decoded value, on malformed data nothing is pushed and false is returned
+*/
+static bool ser_decode(lua_State *L, pulsar_decoder *d, int seen)
+{
+	if ((d->pos >= d->len) || !lua_checkstack(L, 3)) return false;
+	char tag = d->buf[d->pos++];
+	uint64_t v;
+
+	switch (tag) {
+	case SER_NIL: lua_pushnil(L); return true;
+	case SER_FALSE: lua_pushboolean(L, 0); return true;
+	case SER_TRUE: lua_pushboolean(L, 1); return true;
+	case SER_INT: {
+		if (!ser_read_varint(d, &v)) return false;
+		int64_t i = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		lua_pushnumber(L, i);
+		return true;
+	}
+	case SER_DOUBLE: {
+		double n;
+		if (!ser_read_fixed(d, &n, sizeof(double))) return false;
+		lua_pushnumber(L, n);
+		return true;
+	}
+	case SER_STRING: case SER_FUNCTION: {
+		// Loading crafted bytecode is unsafe, functions only come from spawns
+		if ((tag == SER_FUNCTION) && !d->transfer) return false;
+		if (!ser_read_varint(d, &v) || (v > d->len - d->pos)) return false;
+		if (tag == SER_STRING) lua_pushlstring(L, d->buf + d->pos, v);
+		else if (luaL_loadbuffer(L, d->buf + d->pos, v, "spawn function")) { lua_pop(L, 1); return false; }
+		d->pos += v;
+		return true;
+	}
+	case SER_TABLE: {
+		uint32_t narr, nrec;
+		if (!ser_read_fixed(d, &narr, sizeof(uint32_t)) || !ser_read_fixed(d, &nrec, sizeof(uint32_t))) return false;
+		if (d->depth >= SER_MAX_DEPTH) return false;
+		// Each pair takes at least 2 bytes, do not trust bigger hints
+		size_t max = (d->len - d->pos) / 2;
+		if (narr > max) narr = max;
+		if (nrec > max - narr) nrec = max - narr;
+
+		lua_createtable(L, narr, nrec);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, seen, ++d->ntables);
+
+		d->depth++;
+		while (true) {
+			if (d->pos >= d->len) { lua_pop(L, 1); return false; }
+			if (d->buf[d->pos] == SER_TABLE_END) { d->pos++; break; }
+			if (!ser_decode(L, d, seen)) { lua_pop(L, 1); return false; }
+			if (!ser_decode(L, d, seen)) { lua_pop(L, 2); return false; }
+			if (lua_isnil(L, -2)) lua_pop(L, 2);
+			else lua_rawset(L, -3);
+		}
+		d->depth--;
+		return true;
+	}
+	case SER_BUFFER: {
+		char *data;
+		size_t len, cap;
+		if (!d->transfer) return false;
+		if (!ser_read_fixed(d, &data, sizeof(char*)) || !ser_read_fixed(d, &len, sizeof(size_t)) || !ser_read_fixed(d, &cap, sizeof(size_t))) return false;
+		pulsar_buffer_push(L, data, len, cap);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, seen, ++d->ntables);
+		return true;
+	}
+	case SER_REF: {
+		if (!ser_read_varint(d, &v) || (v > (uint64_t)d->ntables)) return false;
+		lua_rawgeti(L, seen, v);
+		if (lua_isnil(L, -1)) { lua_pop(L, 1); return false; }
+		return true;
+	}
+	}
+	return false;
+}
+
+#define SER_DECODE_MALFORMED	-1
+#define SER_DECODE_TOO_MANY	-2
+// Stack room one value may need, a table per nesting level with its key and value
+#define SER_DECODE_SLOTS	(3 * SER_MAX_DEPTH + 4)
+
+/*
+** Pushes the values encoded by pulsar_encode, returns how many, SER_DECODE_MALFORMED if the
+** data is malformed or SER_DECODE_TOO_MANY if the values do not fit on the Lua stack
+*/
+static int pulsar_decode(lua_State *L, const char *buf, size_t len, bool transfer)
+{
+	pulsar_decoder d = { buf, 0, len, 0, 0, transfer };
+	uint64_t n, i;
+	int top = lua_gettop(L);
+	if (!ser_read_varint(&d, &n) || (n > len)) return SER_DECODE_MALFORMED;
+
+	lua_newtable(L);
+	int seen = top + 1;
+	for (i = 0; i < n; i++) {
+		if (!lua_checkstack(L, SER_DECODE_SLOTS)) { lua_settop(L, top); return SER_DECODE_TOO_MANY; }
+		if (!ser_decode(L, &d, seen)) { lua_settop(L, top); return SER_DECODE_MALFORMED; }
+	}
+	lua_remove(L, seen);
+	return n;
+}
+
+static int pulsar_serial_encode(lua_State *L)
+{
+	pulsar_spawn_ret s = { NULL, 0, 0, 0 };
+	pulsar_encode(L, &s, 1, lua_gettop(L), false);
+	lua_pushlstring(L, s.buf, s.bufpos);
+	free(s.buf);
+	return 1;
+}
+
+static int pulsar_serial_decode(lua_State *L)
+{
+	size_t len;
+	const char *buf = luaL_checklstring(L, 1, &len);
+	lua_settop(L, 1);
+	int n = pulsar_decode(L, buf, len, false);
+	if (n < 0) {
+		lua_pushnil(L);
+		if (n == SER_DECODE_TOO_MANY) lua_pushliteral(L, "too many values");
+		else lua_pushliteral(L, "malformed data");
+		return 2;
+	}
+	return n;
+}
+
+#define SPAWN_CACHE_MAX		256
+#define SPAWN_GROUP_CHUNKS	4
+
+static uv_once_t spawn_state_once = UV_ONCE_INIT;
+static uv_key_t spawn_state_key;
+static unsigned int spawn_next_id = 0;
+
+static void spawn_code_unref(pulsar_spawn_code *code) {
+	if (--code->refs) return;
+	free(code->fctcode);
+	if (code->initcode) free(code->initcode);
+	free(code);
+}
+
+static void spawn_state_key_init(void) {
+	uv_key_create(&spawn_state_key);
+}
+
+/*
+** Get the calling worker thread's lua_State, making a new one if needed
+*/
+static pulsar_spawn_state *spawn_state_get(void) {
+	uv_once(&spawn_state_once, spawn_state_key_init);
+	pulsar_spawn_state *st = (pulsar_spawn_state*)uv_key_get(&spawn_state_key);
+	if (!st) {
+		st = malloc(sizeof(pulsar_spawn_state));
+		st->L = NULL;
+		uv_key_set(&spawn_state_key, st);
+	}
+	if (!st->L) {
+		st->L = luaL_newstate();
+		luaL_openlibs(st->L);
+		buffer_createmeta(st->L);
+		lua_newtable(st->L);
+		st->cache_ref = luaL_ref(st->L, LUA_REGISTRYINDEX);
+		st->cached = 0;
+		st->calls = 0;
+	}
+	return st;
+}
+
+static void spawn_state_recycle(pulsar_spawn_state *st) {
+	lua_close(st->L);
+	st->L = NULL;
+}
+
+// Called by pool threads before they exit
+static void spawn_state_close(void) {
+	uv_once(&spawn_state_once, spawn_state_key_init);
+	pulsar_spawn_state *st = (pulsar_spawn_state*)uv_key_get(&spawn_state_key);
+	if (!st) return;
+	if (st->L) spawn_state_recycle(st);
+	free(st);
+	uv_key_set(&spawn_state_key, NULL);
+}
+
+/*
+** Push the spawned function, it is loaded and its init function ran only the first time this state sees it
+*/
+static bool spawn_state_push_function(pulsar_spawn_state *st, pulsar_spawn_code *code, int base) {
+	lua_State *L = st->L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, st->cache_ref);
+	lua_rawgeti(L, -1, code->id);
+	if (!lua_isnil(L, -1)) {
+		lua_remove(L, -2);
+		return true;
+	}
+	lua_pop(L, 1);
+
+	if (code->initcode) {
+		if (luaL_loadbuffer(L, code->initcode, code->initcode_len, "spawned init code") || lua_pcall(L, 0, 0, base)) {
+			printf("Error while running spawn's init function: %s\n", lua_tostring(L, -1));
+			lua_pop(L, 2);
+			return false;
+		}
+	}
+	if (luaL_loadbuffer(L, code->fctcode, code->fctcode_len, "spawned code")) {
+		printf("Error while loading spawned code: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 2);
+		return false;
+	}
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, code->id);
+	lua_remove(L, -2);
+	st->cached++;
+	return true;
+}
+
+/*
+** A chunk of a map or batch finished, store its results and resume the caller after the last one
+*/
+static void spawn_group_done(pulsar_loop *loop, pulsar_spawn *spawn) {
+	pulsar_spawn_group *group = spawn->group;
+	lua_State *L = group->L;
+	int i;
+
+	int nbrets = pulsar_decode(L, spawn->ret.buf, spawn->ret.bufpos, true);
+	free(spawn->ret.buf);
+	if (spawn->failed || (nbrets != 1) || !lua_istable(L, -1)) {
+		if (!group->failed) {
+			group->failed = true;
+			if ((nbrets >= 1) && lua_isstring(L, -nbrets)) lua_pushvalue(L, -nbrets);
+			else lua_pushliteral(L, "could not decode spawn returns");
+			group->err_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		if (nbrets > 0) lua_pop(L, nbrets);
+	} else {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, group->results_ref);
+		for (i = 1; i <= spawn->count; i++) {
+			lua_rawgeti(L, -2, i);
+			lua_rawseti(L, -2, spawn->first + i - 1);
+		}
+		lua_pop(L, 2);
+	}
+
+	// How long the chunk waited for a thread and ran, in milliseconds
+	lua_rawgeti(L, LUA_REGISTRYINDEX, group->timings_ref);
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, spawn->first); lua_setfield(L, -2, "first");
+	lua_pushnumber(L, spawn->count); lua_setfield(L, -2, "items");
+	lua_pushnumber(L, (spawn->started_at - spawn->queued_at) / 1e6); lua_setfield(L, -2, "wait");
+	lua_pushnumber(L, (spawn->finished_at - spawn->started_at) / 1e6); lua_setfield(L, -2, "run");
+	lua_rawseti(L, -2, spawn->chunk);
+	lua_pop(L, 1);
+
+	spawn_code_unref(spawn->code);
+	free(spawn);
+	if (--group->pending) return;
+
+	int nargs = 2;
+	if (group->failed) {
+		lua_pushnil(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, group->err_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, group->err_ref);
+		nargs = 3;
+	}
+	else lua_rawgeti(L, LUA_REGISTRYINDEX, group->results_ref);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, group->timings_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, group->results_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, group->timings_ref);
+
+	int L_ref = group->L_ref;
+	free(group);
+	int res = loop_resume(loop, PULSAR_RESUME_SPAWN, NULL, L, nargs);
+	luaL_unref(L, LUA_REGISTRYINDEX, L_ref);
+	if (res == LUA_ERRRUN) {
+		printf("Error while running spawn's callback: %s\n", lua_tostring(L, -1));
+		traceback(L);
+	}
+}
+
+static void spawn_cb(pulsar_loop *loop, pulsar_spawn *spawn) {
+	if (spawn->group) {
+		spawn_group_done(loop, spawn);
+		return;
+	}
+	lua_State *sL = spawn->L;
+
+	// Decoding does not call any Lua code so the values can go straight onto the paused coroutine
+	int nbrets = pulsar_decode(sL, spawn->ret.buf, spawn->ret.bufpos, true);
+	free(spawn->ret.buf);
+	if (nbrets < 0) {
+		lua_pushnil(sL);
+		if (nbrets == SER_DECODE_TOO_MANY) lua_pushliteral(sL, "too many spawn returns");
+		else lua_pushliteral(sL, "could not decode spawn returns");
+		nbrets = 2;
+	}
+
+	int sL_ref = spawn->L_ref;
+	spawn_code_unref(spawn->code);
+	free(spawn);
+
+	int res = loop_resume(loop, PULSAR_RESUME_SPAWN, NULL, sL, nbrets);
+	luaL_unref(sL, LUA_REGISTRYINDEX, sL_ref);
+	if (res == LUA_ERRRUN) {
+		printf("Error while running spawn's callback: %s\n", lua_tostring(sL, -1));
+		traceback(sL);
+	}
+}
+
+/*
+** Run the function at base+1 on each item of the chunk at base+2, leaving only the results table
+** or the error message at base+1
+*/
+static bool spawn_exec_chunk(lua_State *L, int base, int mode) {
+	int fct = base + 1, chunk = base + 2;
+	int n = lua_objlen(L, chunk);
+	int i, j;
+	lua_createtable(L, n, 0);
+	int results = lua_gettop(L);
+
+	for (i = 1; i <= n; i++) {
+		int top = lua_gettop(L);
+		int nargs = 1;
+		lua_pushvalue(L, fct);
+		lua_rawgeti(L, chunk, i);
+		// Batches pass each entry as the list of arguments
+		if ((mode == SPAWN_BATCH) && lua_istable(L, -1)) {
+			nargs = lua_objlen(L, -1);
+			luaL_checkstack(L, nargs, "too many arguments in batch entry");
+			for (j = 1; j <= nargs; j++) lua_rawgeti(L, top + 2, j);
+			lua_remove(L, top + 2);
+		}
+
+		if (lua_pcall(L, nargs, (mode == SPAWN_MAP) ? 1 : LUA_MULTRET, base)) {
+			lua_replace(L, fct);
+			lua_settop(L, fct);
+			return false;
+		}
+
+		if (mode == SPAWN_MAP) {
+			lua_rawseti(L, results, i);
+		} else {
+			int nbrets = lua_gettop(L) - top;
+			lua_createtable(L, nbrets, 1);
+			lua_insert(L, top + 1);
+			for (j = nbrets; j >= 1; j--) lua_rawseti(L, top + 1, j);
+			lua_pushnumber(L, nbrets);
+			lua_setfield(L, top + 1, "n");
+			lua_rawseti(L, results, i);
+		}
+	}
+	lua_replace(L, fct);
+	lua_settop(L, fct);
+	return true;
+}
+
+static void spawn_exec(pulsar_spawn *spawn) {
+	spawn->started_at = uv_hrtime();
+	pulsar_spawn_state *st = spawn_state_get();
+	lua_State *L = st->L;
+	lua_pushcfunction(L, traceback);  /* push traceback function */
+	int base = lua_gettop(L);
+	bool failed = true;
+
+	// Push main function
+	if (spawn_state_push_function(st, spawn->code, base)) {
+		// Push the args and call the main function with them
+		int nargs = pulsar_decode(L, spawn->arg.buf, spawn->arg.bufpos, true);
+		if ((nargs == 1) && (spawn->mode != SPAWN_CALL) && lua_istable(L, -1)) {
+			failed = !spawn_exec_chunk(L, base, spawn->mode);
+		} else if ((nargs >= 0) && (spawn->mode == SPAWN_CALL)) {
+			failed = lua_pcall(L, nargs, LUA_MULTRET, base) != 0;
+		} else {
+			lua_settop(L, base);
+			lua_pushliteral(L, "could not decode spawn arguments");
+		}
+	} else {
+		lua_pushliteral(L, "could not load spawned code");
+	}
+	free(spawn->arg.buf);
+	
+	// Serialize returns
+	pulsar_spawn_ret *ret = &spawn->ret;
+	ret->buf = NULL; ret->bufpos = 0; ret->buflen = 0;
+	pulsar_encode(L, ret, base + 1, lua_gettop(L) - base, true);
+	spawn->failed = failed;
 
-	idle->w_timeout = (uv_idle_t*)malloc(sizeof(uv_idle_t));
-	idle->w_timeout->data = idle;
-	uv_idle_init(loop->loop, idle->w_timeout);
-	return 1;
-}
+	lua_settop(L, base - 1);  /* remove traceback function and returns */
 
+	// Start afresh from time to time, and always after an error
+	st->calls++;
+	if (failed || (spawn->code->recycle && (st->calls >= spawn->code->recycle)) || (st->cached >= SPAWN_CACHE_MAX))
+		spawn_state_recycle(st);
+	spawn->finished_at = uv_hrtime();
+}
 
 /**************************************************************************************
- ** Spawns
+ ** Spawns thread pool
  **************************************************************************************/
+static void spawn_deque_push(pulsar_spawn_deque *dq, pulsar_spawn *spawn) {
+	int prio = spawn->priority;
+	uv_mutex_lock(&dq->lock);
+	spawn->next = NULL;
+	spawn->prev = dq->tail[prio];
+	if (dq->tail[prio]) dq->tail[prio]->next = spawn;
+	else dq->head[prio] = spawn;
+	dq->tail[prio] = spawn;
+	dq->nb[prio]++;
+	uv_mutex_unlock(&dq->lock);
+}
 
-static void writeTblFixed(pulsar_spawn_ret *s, const char *data, long len) {
-	if (len + s->bufpos + 1 >= s->buflen) {
-		s->buf = realloc(s->buf, (len + s->bufpos + 1) * sizeof(char));
-		s->buflen = len + s->bufpos + 1;
+// The owner takes the oldest job, thieves take the newest so they rarely contend with it
+static pulsar_spawn *spawn_deque_pop(pulsar_spawn_deque *dq, int prio, bool owner) {
+	if (!dq->nb[prio]) return NULL;
+	uv_mutex_lock(&dq->lock);
+	pulsar_spawn *spawn = owner ? dq->head[prio] : dq->tail[prio];
+	if (spawn) {
+		if (spawn->prev) spawn->prev->next = spawn->next;
+		else dq->head[prio] = spawn->next;
+		if (spawn->next) spawn->next->prev = spawn->prev;
+		else dq->tail[prio] = spawn->prev;
+		dq->nb[prio]--;
 	}
-	memcpy(s->buf + s->bufpos, data, len);
-	s->bufpos += len;
+	uv_mutex_unlock(&dq->lock);
+	return spawn;
 }
-#define writeTbl(s, data) { writeTblFixed(s, data, strlen(data)); }
 
-static void tbl_dump_string(pulsar_spawn_ret *s, const char *str, size_t l)
-{
-	while (l--) {
-		switch (*str) {
-		case '"': case '\\': case '\n': {
-			writeTblFixed(s, "\\", 1);
-			writeTblFixed(s, str, 1);
-			break;
-		}
-		case '\r': {
-			writeTblFixed(s, "\\r", 2);
-			break;
-		}
-		case '\0': {
-			writeTblFixed(s, "\\000", 4);
-			break;
-		}
-		default: {
-			writeTblFixed(s, str, 1);
-			break;
-		}
+static pulsar_spawn *spawn_pool_take(pulsar_spawn_pool *pool, pulsar_spawn_worker *w) {
+	int prio, i;
+	for (prio = 0; prio < SPAWN_PRIORITIES; prio++) {
+		pulsar_spawn *spawn = spawn_deque_pop(&w->deque, prio, true);
+		if (spawn) return spawn;
+
+		// Nothing of this priority here, look at the other threads
+		for (i = 1; i < pool->nthreads; i++) {
+			pulsar_spawn_worker *victim = &pool->workers[(w->id + i) % pool->nthreads];
+			spawn = spawn_deque_pop(&victim->deque, prio, false);
+			if (spawn) {
+				w->stolen++;
+				return spawn;
+			}
 		}
-		str++;
 	}
+	return NULL;
 }
 
-static int tbl_dump_function(lua_State *L, const void* p, size_t sz, void* ud)
-{
-	pulsar_spawn_ret *s = (pulsar_spawn_ret*)ud;
-	tbl_dump_string(s, p, sz);
-	return 0;
-}
-
-static void tbl_basic_serialize(lua_State *L, pulsar_spawn_ret *s, int type, int idx)
-{
-	if (type == LUA_TNIL) {
-		writeTblFixed(s, "nil", 3);
-	} else if (type == LUA_TBOOLEAN) {
-		if (lua_toboolean(L, idx)) { writeTblFixed(s, "true", 4); }
-		else { writeTblFixed(s, "false", 5); }
-	} else if (type == LUA_TNUMBER) {
-		lua_pushvalue(L, idx);
-		size_t len;
-		const char *n = lua_tolstring(L, -1, &len);
-		writeTblFixed(s, n, len);
-		lua_pop(L, 1);
-	} else if (type == LUA_TSTRING) {
-		size_t len;
-		const char *str = lua_tolstring(L, idx, &len);
-		writeTblFixed(s, "\"", 1);
-		tbl_dump_string(s, str, len);
-		writeTblFixed(s, "\"", 1);
-	} else if (type == LUA_TFUNCTION) {
-		writeTblFixed(s, "loadstring(\"", 12);
-		lua_dump(L, tbl_dump_function, s);
-		writeTblFixed(s, "\")", 2);
-	} else if (type == LUA_TTABLE) {
-		int ktype, etype;
+static void spawn_pool_thread(void *arg) {
+	pulsar_spawn_worker *w = (pulsar_spawn_worker*)arg;
+	pulsar_spawn_pool *pool = w->pool;
 
-		writeTblFixed(s, "{", 1);
-		/* table is in the stack at index 't' */
-		lua_pushnil(L);  /* first key */
+	while (true) {
+		// Claim one of the queued jobs, it is then guaranteed to be found in one of the deques
+		uv_mutex_lock(&pool->lock);
+		while (!pool->pending && !pool->stopping) uv_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stopping) {
+			uv_mutex_unlock(&pool->lock);
+			break;
+		}
+		pool->pending--;
+		uv_mutex_unlock(&pool->lock);
 
-		while (lua_next(L, idx - 1) != 0)
-		{
-			ktype = lua_type(L, -2);
-			etype = lua_type(L, -1);
+		pulsar_spawn *spawn;
+		while (!(spawn = spawn_pool_take(pool, w)));
 
-			// Only save allowed types
-			if (
-				((ktype == LUA_TBOOLEAN) || (ktype == LUA_TNUMBER) || (ktype == LUA_TSTRING) || (ktype == LUA_TFUNCTION) || (ktype == LUA_TTABLE)) &&
-				((etype == LUA_TBOOLEAN) || (etype == LUA_TNUMBER) || (etype == LUA_TSTRING) || (etype == LUA_TFUNCTION) || (etype == LUA_TTABLE))
-				)
-			{
-				writeTblFixed(s, "[", 1);
-				tbl_basic_serialize(L, s, ktype, -2);
-				writeTblFixed(s, "]=", 2);
-				tbl_basic_serialize(L, s, etype, -1);
-				writeTblFixed(s, ",\n", 2);
-			}
+		spawn_exec(spawn);
+		w->executed++;
 
-			/* removes 'value'; keeps 'key' for next iteration */
-			lua_pop(L, 1);
-		}
-		writeTblFixed(s, "}\n", 2);
-	} else {
-		printf("*WARNING* can not pass to/from spawn a value of type %s\n", lua_typename(L, type));
+		uv_mutex_lock(&pool->done_lock);
+		spawn->next = pool->done;
+		pool->done = spawn;
+		uv_mutex_unlock(&pool->done_lock);
+		uv_async_send(&pool->async);
 	}
+	spawn_state_close();
 }
 
-const char *spawn_ret_read(lua_State *L, void *data, size_t *size) {
-	pulsar_spawn_ret *ret = (pulsar_spawn_ret *)data;
-	if (!ret->bufpos) return NULL;
-	*size = ret->bufpos;
-	ret->bufpos = 0;
-	return ret->buf;
-}
+static void spawn_pool_async_cb(uv_async_t *handle, int status) {
+	pulsar_spawn_pool *pool = (pulsar_spawn_pool*)handle->data;
+	uv_mutex_lock(&pool->done_lock);
+	pulsar_spawn *spawn = pool->done;
+	pool->done = NULL;
+	uv_mutex_unlock(&pool->done_lock);
+
+	while (spawn) {
+		pulsar_spawn *next = spawn->next;
+		int prio = spawn->priority;
+		uint64_t wait = spawn->started_at - spawn->queued_at;
+		pool->completed[prio]++;
+		pool->wait_total[prio] += wait;
+		if (wait > pool->wait_max[prio]) pool->wait_max[prio] = wait;
+		pool->inflight--;
+		hist_add(&pool->loop->metrics.spawn_wait, wait);
+		hist_add(&pool->loop->metrics.spawn_run, spawn->finished_at - spawn->started_at);
+
+		spawn_cb(pool->loop, spawn);
+		spawn = next;
+	}
 
-static void spawn_cb(uv_work_t *_watcher, int status) {
-	pulsar_spawn *spawn = (pulsar_spawn *)_watcher;
+	// Do not keep the loop running for nothing
+	if (!pool->inflight) uv_unref((uv_handle_t*)&pool->async);
+}
 
-	// We make a new coroutine to run the return function inside because the calling coroutine is currently paused and cant be used to call functions
-	pulsar_spawn_ret *ret = &spawn->ret;
-	lua_State *L = lua_newthread(spawn->L);
-	lua_load(L, spawn_ret_read, ret, "spawned code return");
-	lua_pcall(L, 0, ret->nbrets, 0);
-	free(ret->buf);
-	lua_xmove(L, spawn->L, ret->nbrets);
-	lua_remove(spawn->L, -ret->nbrets - 1);
-
-	int res = lua_resume(spawn->L, ret->nbrets);
-	luaL_unref(spawn->L, LUA_REGISTRYINDEX, spawn->L_ref);
-	free(spawn);
-	if (res == LUA_ERRRUN) {
-		printf("Error while running spawn's callback: %s\n", lua_tostring(spawn->L, -1));
-		traceback(spawn->L);
+static pulsar_spawn_pool *spawn_pool_get(pulsar_loop *loop) {
+	if (loop->spawn_pool) return loop->spawn_pool;
+	int i;
+	pulsar_spawn_pool *pool = (pulsar_spawn_pool*)calloc(1, sizeof(pulsar_spawn_pool));
+	pool->loop = loop;
+	pool->nthreads = loop->spawn_threads;
+	pool->workers = (pulsar_spawn_worker*)calloc(pool->nthreads, sizeof(pulsar_spawn_worker));
+	uv_mutex_init(&pool->lock);
+	uv_cond_init(&pool->cond);
+	uv_mutex_init(&pool->done_lock);
+	uv_async_init(loop->loop, &pool->async, spawn_pool_async_cb);
+	pool->async.data = pool;
+	uv_unref((uv_handle_t*)&pool->async);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		pulsar_spawn_worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->id = i;
+		uv_mutex_init(&w->deque.lock);
+		uv_thread_create(&w->thread, spawn_pool_thread, w);
 	}
+	loop->spawn_pool = pool;
+	return pool;
 }
 
-const char *spawn_read(lua_State *L, void *data, size_t *size) {
-	pulsar_spawn *spawn = (pulsar_spawn *)data;
-	if (!spawn->fctcode_len) return NULL;
-	*size = spawn->fctcode_len;
-	spawn->fctcode_len = 0;
-	return spawn->fctcode;
+static void spawn_pool_submit(pulsar_loop *loop, pulsar_spawn *spawn) {
+	pulsar_spawn_pool *pool = spawn_pool_get(loop);
+	pulsar_spawn_worker *w = &pool->workers[pool->next];
+	pool->next = (pool->next + 1) % pool->nthreads;
+	spawn_deque_push(&w->deque, spawn);
+
+	uv_mutex_lock(&pool->lock);
+	pool->pending++;
+	if (pool->pending > pool->max_queued) pool->max_queued = pool->pending;
+	uv_cond_signal(&pool->cond);
+	uv_mutex_unlock(&pool->lock);
+
+	pool->submitted[spawn->priority]++;
+	loop->metrics.spawns++;
+	if (!pool->inflight++) uv_ref((uv_handle_t*)&pool->async);
 }
 
-static void spawn_exec(uv_work_t *req) {
-	pulsar_spawn *spawn = (pulsar_spawn *)req;
-	lua_State *L = luaL_newstate();
-	luaL_openlibs(L);
-	lua_pushcfunction(L, traceback);  /* push traceback function */
-	int base = lua_gettop(L);
-
-	// Push main function
-	lua_load(L, spawn_read, spawn, "spawned code");
-	free(spawn->fctcode);
+static void spawn_pool_close_cb(uv_handle_t *handle) {
+	pulsar_spawn_pool *pool = (pulsar_spawn_pool*)handle->data;
+	free(pool->workers);
+	free(pool);
+}
 
-	// Push args function and call it to get the args
-	lua_load(L, spawn_ret_read, &spawn->arg, "spawned code args");
+/*
+** A job the pool will not run answers its caller as if it failed with "loop closed"
+** Buffers moved into its arguments belong to the encoded data, decoding them lets the
+** GC free their memory
+*/
+static void spawn_drop(lua_State *L, pulsar_loop *loop, pulsar_spawn *spawn) {
+	int top = lua_gettop(L);
+	pulsar_decode(L, spawn->arg.buf, spawn->arg.bufpos, true);
+	lua_settop(L, top);
 	free(spawn->arg.buf);
-	lua_pcall(L, 0, spawn->arg.nbrets, 0);
 
-	// Call the main functions with the args
-	lua_pcall(L, spawn->arg.nbrets, LUA_MULTRET, base);
-	
-	// Count & serialize returns
-	int nbrets = lua_gettop(L) - base;
+	if (!spawn->group) lua_pushnil(L);
+	lua_pushliteral(L, "loop closed");
 	pulsar_spawn_ret *ret = &spawn->ret;
-	ret->buf = malloc(sizeof(char) * 32);
-	ret->buflen = 32;
-	ret->buf[0] = 'r'; ret->buf[1] = 'e'; ret->buf[2] = 't'; ret->buf[3] = 'u'; ret->buf[4] = 'r'; ret->buf[5] = 'n'; ret->buf[6] = ' ';
-	ret->bufpos = 7;
-	
-	if (nbrets > 0) {
-		ret->nbrets = nbrets;
-		while (nbrets > 0) {
-			tbl_basic_serialize(L, ret, lua_type(L, -nbrets), -nbrets);
-			nbrets--;
-			if (nbrets) writeTblFixed(ret, ",", 1);
+	ret->buf = NULL; ret->bufpos = 0; ret->buflen = 0;
+	pulsar_encode(L, ret, top + 1, lua_gettop(L) - top, true);
+	lua_settop(L, top);
+	spawn->failed = true;
+	spawn->started_at = spawn->finished_at = uv_hrtime();
+	spawn_cb(loop, spawn);
+}
+
+/*
+** Stop the threads, waiting for the jobs they are running to finish: closing the loop blocks
+** until then. Finished jobs are handed to their callers, the ones not started yet are dropped
+*/
+static void spawn_pool_free(lua_State *L, pulsar_loop *loop) {
+	pulsar_spawn_pool *pool = loop->spawn_pool;
+	int i, prio;
+	if (!pool) return;
+
+	uv_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	uv_cond_broadcast(&pool->cond);
+	uv_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++) uv_thread_join(&pool->workers[i].thread);
+	loop->spawn_pool = NULL;
+
+	while (pool->done) {
+		pulsar_spawn *spawn = pool->done;
+		pool->done = spawn->next;
+		spawn_cb(loop, spawn);
+	}
+	for (i = 0; i < pool->nthreads; i++) {
+		pulsar_spawn_worker *w = &pool->workers[i];
+		for (prio = 0; prio < SPAWN_PRIORITIES; prio++) {
+			pulsar_spawn *spawn;
+			while ((spawn = spawn_deque_pop(&w->deque, prio, true))) spawn_drop(L, loop, spawn);
 		}
-		lua_pop(L, nbrets);
-	} else {
-		ret->nbrets = 1;
-		ret->buf[7] = 'n'; ret->buf[8] = 'i'; ret->buf[9] = 'l';
-		ret->bufpos = 10;
+		uv_mutex_destroy(&w->deque.lock);
 	}
-	ret->buf[ret->bufpos] = '\0';
-
-	lua_remove(L, base);  /* remove traceback function */
-	lua_close(L);
+	uv_mutex_destroy(&pool->lock);
+	uv_cond_destroy(&pool->cond);
+	uv_mutex_destroy(&pool->done_lock);
+	uv_close((uv_handle_t*)&pool->async, spawn_pool_close_cb);
 }
 
-static int spawn_dump(lua_State *L, const void* p, size_t sz, void* ud)
-{
-	pulsar_spawn_base *sbase = (pulsar_spawn_base*)ud;
-	sbase->fctcode = realloc(sbase->fctcode, sbase->fctcode_len + sz);
-	memcpy(sbase->fctcode + sbase->fctcode_len, p, sz);
-	sbase->fctcode_len += sz;
-	return 0;
+static void spawn_queue(pulsar_spawn_base *sbase, pulsar_spawn *spawn) {
+	spawn->code = sbase->code;
+	spawn->code->refs++;
+	spawn->priority = spawn->code->priority;
+	spawn->queued_at = uv_hrtime();
+	spawn_pool_submit(sbase->loop, spawn);
 }
 
 static int pulsar_spawn_call(lua_State *L)
@@ -1031,41 +4966,89 @@ static int pulsar_spawn_call(lua_State *L)
 	pulsar_spawn_base *sbase = (pulsar_spawn_base *)luaL_checkudata (L, 1, MT_PULSAR_SPAWN);
 	pulsar_spawn *spawn = (pulsar_spawn*)malloc(sizeof(pulsar_spawn));
 
-	pulsar_spawn_ret *ret = &spawn->arg;
-	ret->buf = malloc(sizeof(char) * 32);
-	ret->buflen = 32;
-	ret->buf[0] = 'r'; ret->buf[1] = 'e'; ret->buf[2] = 't'; ret->buf[3] = 'u'; ret->buf[4] = 'r'; ret->buf[5] = 'n'; ret->buf[6] = ' ';
-	ret->bufpos = 7;
-	
-	int nbrets = lua_gettop(L) - 1;
-	if (nbrets > 0) {
-		ret->nbrets = nbrets;
-		while (nbrets > 0) {
-			tbl_basic_serialize(L, ret, lua_type(L, -nbrets), -nbrets);
-			nbrets--;
-			if (nbrets) writeTblFixed(ret, ",", 1);
-		}
-		lua_pop(L, nbrets);
-	} else {
-		ret->nbrets = 1;
-		ret->buf[7] = 'n'; ret->buf[8] = 'i'; ret->buf[9] = 'l';
-		ret->bufpos = 10;
+	pulsar_spawn_ret *arg = &spawn->arg;
+	arg->buf = NULL; arg->bufpos = 0; arg->buflen = 0;
+	pulsar_encode(L, arg, 2, lua_gettop(L) - 1, true);
+
+	spawn->mode = SPAWN_CALL;
+	spawn->group = NULL;
+	lua_pushthread(L); spawn->L = lua_tothread(L, -1); spawn->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	spawn_queue(sbase, spawn);
+	return lua_yield(L, 0);
+}
+
+/*
+** Split the list in chunks each sent to the thread pool as a single spawn
+*/
+static int spawn_group_call(lua_State *L, int mode)
+{
+	pulsar_spawn_base *sbase = (pulsar_spawn_base *)luaL_checkudata (L, 1, MT_PULSAR_SPAWN);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int n = lua_objlen(L, 2);
+	int chunk = (n + SPAWN_GROUP_CHUNKS - 1) / SPAWN_GROUP_CHUNKS;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "chunk");
+		if (lua_isnumber(L, -1)) chunk = lua_tonumber(L, -1);
+		lua_pop(L, 1);
 	}
-	ret->buf[ret->bufpos] = '\0';
+	if (chunk < 1) chunk = 1;
+	int nbchunks = (n + chunk - 1) / chunk;
+	int c, i;
 
+	if (!n) {
+		lua_newtable(L);
+		lua_newtable(L);
+		return 2;
+	}
 
-	spawn->fctcode = (char*)malloc(sbase->fctcode_len);
-	memcpy(spawn->fctcode, sbase->fctcode, sbase->fctcode_len);
-	spawn->fctcode_len = sbase->fctcode_len;
-	lua_pushthread(L); spawn->L = lua_tothread(L, -1); spawn->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	uv_queue_work(sbase->loop->loop, (uv_work_t*)&spawn->work, spawn_exec, spawn_cb);
+	pulsar_spawn_group *group = (pulsar_spawn_group*)malloc(sizeof(pulsar_spawn_group));
+	group->pending = nbchunks;
+	group->failed = false;
+	group->err_ref = LUA_NOREF;
+	lua_createtable(L, n, 0); group->results_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_createtable(L, nbchunks, 0); group->timings_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushthread(L); group->L = lua_tothread(L, -1); group->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	for (c = 0; c < nbchunks; c++) {
+		pulsar_spawn *spawn = (pulsar_spawn*)malloc(sizeof(pulsar_spawn));
+		spawn->mode = mode;
+		spawn->group = group;
+		spawn->L = group->L;
+		spawn->L_ref = LUA_NOREF;
+		spawn->chunk = c + 1;
+		spawn->first = c * chunk + 1;
+		spawn->count = (spawn->first + chunk - 1 <= n) ? chunk : n - spawn->first + 1;
+
+		lua_createtable(L, spawn->count, 0);
+		for (i = 0; i < spawn->count; i++) {
+			lua_rawgeti(L, 2, spawn->first + i);
+			lua_rawseti(L, -2, i + 1);
+		}
+		pulsar_spawn_ret *arg = &spawn->arg;
+		arg->buf = NULL; arg->bufpos = 0; arg->buflen = 0;
+		pulsar_encode(L, arg, lua_gettop(L), 1, true);
+		lua_pop(L, 1);
+
+		spawn_queue(sbase, spawn);
+	}
 	return lua_yield(L, 0);
 }
 
+static int pulsar_spawn_map(lua_State *L)
+{
+	return spawn_group_call(L, SPAWN_MAP);
+}
+
+static int pulsar_spawn_batch(lua_State *L)
+{
+	return spawn_group_call(L, SPAWN_BATCH);
+}
+
 static int pulsar_spawn_free(lua_State *L)
 {
 	pulsar_spawn_base *sbase = (pulsar_spawn_base *)luaL_checkudata (L, 1, MT_PULSAR_SPAWN);
-	if (sbase->fctcode) free(sbase->fctcode);
+	if (sbase->code) spawn_code_unref(sbase->code);
+	sbase->code = NULL;
 	return 0;
 }
 
@@ -1074,34 +5057,217 @@ static int pulsar_spawn_new(lua_State *L)
 	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
 	if (!lua_isfunction(L, 2)) { lua_pushstring(L, "argument 1 is not a function"); lua_error(L); return 0; }
 
+	pulsar_spawn_code *code = (pulsar_spawn_code*)malloc(sizeof(pulsar_spawn_code));
+	code->id = __sync_add_and_fetch(&spawn_next_id, 1);
+	code->refs = 1;
+	code->recycle = 0;
+	code->priority = SPAWN_PRIORITY_LOW;
+	code->initcode = NULL;
+	code->initcode_len = 0;
+
+	pulsar_spawn_ret dump = { NULL, 0, 0, 0 };
+	lua_pushvalue(L, 2);
+	lua_dump(L, spawn_dump, &dump);
+	lua_pop(L, 1);
+	code->fctcode = dump.buf;
+	code->fctcode_len = dump.bufpos;
+
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "init");
+		if (lua_isfunction(L, -1)) {
+			pulsar_spawn_ret idump = { NULL, 0, 0, 0 };
+			lua_dump(L, spawn_dump, &idump);
+			code->initcode = idump.buf;
+			code->initcode_len = idump.bufpos;
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "recycle");
+		if (lua_isnumber(L, -1)) code->recycle = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 3, "priority");
+		if (lua_isstring(L, -1) && !strcmp(lua_tostring(L, -1), "high")) code->priority = SPAWN_PRIORITY_HIGH;
+		lua_pop(L, 1);
+	}
+
 	// Initialize and start a watcher to accepts client requests
 	pulsar_spawn_base *sbase = (pulsar_spawn_base*)lua_newuserdata(L, sizeof(pulsar_spawn_base));
 	pulsar_setmeta(L, MT_PULSAR_SPAWN);
 	sbase->loop = loop;
-	sbase->fctcode = NULL;
-	sbase->fctcode_len = 0;
-	lua_pushvalue(L, 2);
-	lua_dump(L, spawn_dump, sbase);
+	sbase->code = code;
+
+	return 1;
+}
+
+/**************************************************************************************
+ ** Cluster
+ **************************************************************************************/
+// Registry keys, their address is what matters
+static const char pulsar_cluster_key = 'c';
+static const char pulsar_default_loop_key = 'd';
+
+/*
+** The cluster thread this lua_State runs in, if any
+*/
+static pulsar_cluster_thread *cluster_thread_get(lua_State *L) {
+	lua_pushlightuserdata(L, (void*)&pulsar_cluster_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	pulsar_cluster_thread *ct = (pulsar_cluster_thread*)lua_touserdata(L, -1);
 	lua_pop(L, 1);
+	return ct;
+}
+
+/*
+** Each thread runs its own lua_State, it is expected to make a loop and run it
+*/
+static void cluster_thread_run(void *arg) {
+	pulsar_cluster_thread *ct = (pulsar_cluster_thread*)arg;
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	lua_pushlightuserdata(L, (void*)&pulsar_cluster_key);
+	lua_pushlightuserdata(L, ct);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+	lua_pushcfunction(L, traceback);  /* push traceback function */
+	int base = lua_gettop(L);
+
+	int err;
+	if (ct->code) err = luaL_loadbuffer(L, ct->code, ct->code_len, "cluster code");
+	else err = luaL_loadfile(L, ct->script);
+	if (!err) {
+		lua_pushnumber(L, ct->id);
+		lua_pushnumber(L, ct->nthreads);
+		err = lua_pcall(L, 2, 0, base);
+	}
+	if (err) printf("Error while running cluster thread %d: %s\n", ct->id, lua_tostring(L, -1));
+
+	lua_close(L);
+	ct->running = false;
+}
+
+static int cluster_dump(lua_State *L, const void* p, size_t sz, void* ud)
+{
+	pulsar_cluster_thread *ct = (pulsar_cluster_thread*)ud;
+	ct->code = realloc(ct->code, ct->code_len + sz);
+	memcpy(ct->code + ct->code_len, p, sz);
+	ct->code_len += sz;
+	return 0;
+}
+
+static int pulsar_cluster_new(lua_State *L)
+{
+	int nthreads = luaL_checknumber(L, 1);
+	if (nthreads < 1) { lua_pushstring(L, "argument 1 must be at least 1"); lua_error(L); return 0; }
+	if (!lua_isfunction(L, 2) && !lua_isstring(L, 2)) { lua_pushstring(L, "argument 2 is not a function or a script"); lua_error(L); return 0; }
+
+	pulsar_cluster *cluster = (pulsar_cluster*)lua_newuserdata(L, sizeof(pulsar_cluster));
+	pulsar_setmeta(L, MT_PULSAR_CLUSTER);
+	cluster->nthreads = nthreads;
+	cluster->joined = false;
+	cluster->threads = calloc(nthreads, sizeof(pulsar_cluster_thread));
+
+	int i;
+	for (i = 0; i < nthreads; i++) {
+		pulsar_cluster_thread *ct = &cluster->threads[i];
+		ct->id = i + 1;
+		ct->nthreads = nthreads;
+		if (lua_isfunction(L, 2)) {
+			lua_pushvalue(L, 2);
+			lua_dump(L, cluster_dump, ct);
+			lua_pop(L, 1);
+		} else {
+			ct->script = strdup(lua_tostring(L, 2));
+		}
+		ct->running = true;
+		ct->started = !uv_thread_create(&ct->thread, cluster_thread_run, ct);
+		if (!ct->started) {
+			printf("Error while creating cluster thread %d\n", ct->id);
+			ct->running = false;
+		}
+	}
+	return 1;
+}
+
+static int pulsar_cluster_wait(lua_State *L)
+{
+	pulsar_cluster *cluster = (pulsar_cluster *)luaL_checkudata (L, 1, MT_PULSAR_CLUSTER);
+	if (cluster->joined) return 0;
+	int i;
+	for (i = 0; i < cluster->nthreads; i++) if (cluster->threads[i].started) uv_thread_join(&cluster->threads[i].thread);
+	cluster->joined = true;
+	return 0;
+}
 
+static int pulsar_cluster_stats(lua_State *L)
+{
+	pulsar_cluster *cluster = (pulsar_cluster *)luaL_checkudata (L, 1, MT_PULSAR_CLUSTER);
+	lua_createtable(L, cluster->nthreads, 0);
+	int i;
+	for (i = 0; i < cluster->nthreads; i++) {
+		pulsar_cluster_thread *ct = &cluster->threads[i];
+		lua_newtable(L);
+		lua_pushnumber(L, ct->id); lua_setfield(L, -2, "id");
+		lua_pushboolean(L, ct->running); lua_setfield(L, -2, "running");
+		lua_pushnumber(L, ct->accepts); lua_setfield(L, -2, "accepts");
+		lua_pushnumber(L, ct->accept_errors); lua_setfield(L, -2, "accept_errors");
+		lua_pushnumber(L, ct->clients); lua_setfield(L, -2, "clients");
+		lua_rawseti(L, -2, i + 1);
+	}
 	return 1;
 }
 
+static int pulsar_cluster_free(lua_State *L)
+{
+	pulsar_cluster *cluster = (pulsar_cluster *)luaL_checkudata (L, 1, MT_PULSAR_CLUSTER);
+	if (!cluster->threads) return 0;
+
+	// Threads still running use their slot, let them have it
+	int i;
+	for (i = 0; i < cluster->nthreads; i++) if (cluster->threads[i].running) return 0;
+
+	for (i = 0; i < cluster->nthreads; i++) {
+		if (cluster->threads[i].code) free(cluster->threads[i].code);
+		if (cluster->threads[i].script) free(cluster->threads[i].script);
+	}
+	free(cluster->threads);
+	cluster->threads = NULL;
+	return 0;
+}
+
 /**************************************************************************************
  ** Loop calls
  **************************************************************************************/
-static int main_loop_ref = LUA_NOREF;
+static void pulsar_loop_init(lua_State *L, pulsar_loop *loop, uv_loop_t *uvloop) {
+	loop->loop = uvloop;
+	wheel_init(&loop->wheel, uvloop);
+	sched_init(&loop->sched, uvloop);
+	dns_init(&loop->dns);
+	buffer_pool_init(&loop->pool);
+	loop->read_size = DEFAULT_READ_SIZE;
+	co_pool_init(&loop->co_pool);
+	loop->cluster = cluster_thread_get(L);
+	loop->spawn_pool = NULL;
+	loop->spawn_threads = SPAWN_DEFAULT_THREADS;
+	memset(&loop->metrics, 0, sizeof(pulsar_metrics));
+	monitor_init(&loop->monitor);
+	loop->resuming.kind = PULSAR_RESUME_TASK;
+	loop->resuming.ptr = NULL;
+	loop->resuming.L = NULL;
+}
+
 static int pulsar_loop_default(lua_State *L)
 {
-	if (main_loop_ref == LUA_NOREF) {
-		pulsar_loop *loop = (pulsar_loop*)lua_newuserdata(L, sizeof(pulsar_loop));
-		pulsar_setmeta(L, MT_PULSAR_LOOP);
-		loop->loop = uv_default_loop();
-		lua_pushvalue(L, -1);
-		main_loop_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	} else {
-		lua_rawgeti(L, LUA_REGISTRYINDEX, main_loop_ref);
-	}
+	lua_pushlightuserdata(L, (void*)&pulsar_default_loop_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_isnil(L, -1)) return 1;
+	lua_pop(L, 1);
+
+	// libuv's default loop belongs to the main thread, cluster threads get their own
+	pulsar_loop *loop = (pulsar_loop*)lua_newuserdata(L, sizeof(pulsar_loop));
+	pulsar_setmeta(L, MT_PULSAR_LOOP);
+	pulsar_loop_init(L, loop, cluster_thread_get(L) ? uv_loop_new() : uv_default_loop());
+	lua_pushlightuserdata(L, (void*)&pulsar_default_loop_key);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
 	return 1;
 }
 
@@ -1109,17 +5275,257 @@ static int pulsar_loop_new(lua_State *L)
 {
 	pulsar_loop *loop = (pulsar_loop*)lua_newuserdata(L, sizeof(pulsar_loop));
 	pulsar_setmeta(L, MT_PULSAR_LOOP);
-	loop->loop = uv_loop_new();
+	pulsar_loop_init(L, loop, uv_loop_new());
 	return 1;
 }
 
 static int pulsar_loop_close(lua_State *L)
 {
 	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	if (!loop->loop) return 0;
+	spawn_pool_free(L, loop);
+	sched_free(&loop->sched);
+	dns_free(&loop->dns);
+	if (loop->monitor.lag_timer) uv_close((uv_handle_t*)loop->monitor.lag_timer, close_cb);
+	luaL_unref(L, LUA_REGISTRYINDEX, loop->monitor.cb_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, loop->monitor.L_ref);
+	uv_close((uv_handle_t*)&loop->wheel.timer, NULL);
+	uv_run(loop->loop, UV_RUN_NOWAIT);
 	uv_loop_delete(loop->loop);
+	loop->loop = NULL;
+	buffer_pool_free(&loop->pool);
+	co_pool_free(&loop->co_pool);
 	return 0;
 }
 
+static int pulsar_loop_scheduler(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_scheduler *sched = &loop->sched;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "enabled");
+		sched->enabled = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "budget");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) > 0)) sched->budget = lua_tonumber(L, -1) * 1000000;
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "quantum");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) >= 1)) sched->quantum = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	lua_newtable(L);
+	lua_pushboolean(L, sched->enabled); lua_setfield(L, -2, "enabled");
+	lua_pushnumber(L, sched->budget / 1000000.0); lua_setfield(L, -2, "budget");
+	lua_pushnumber(L, sched->quantum); lua_setfield(L, -2, "quantum");
+	lua_pushnumber(L, sched->ticks); lua_setfield(L, -2, "ticks");
+	lua_pushnumber(L, sched->exhausted); lua_setfield(L, -2, "exhausted");
+	int cls;
+	for (cls = 0; cls < PULSAR_CLASSES; cls++) {
+		lua_newtable(L);
+		lua_pushnumber(L, sched->nb[cls]); lua_setfield(L, -2, "queued");
+		lua_pushnumber(L, sched->queued[cls]); lua_setfield(L, -2, "total");
+		lua_pushnumber(L, sched->ran[cls]); lua_setfield(L, -2, "ran");
+		lua_pushnumber(L, sched->ran[cls] ? sched->wait_total[cls] / 1000000.0 / sched->ran[cls] : 0); lua_setfield(L, -2, "wait_avg");
+		lua_pushnumber(L, sched->wait_max[cls] / 1000000.0); lua_setfield(L, -2, "wait_max");
+		lua_setfield(L, -2, sched_class_names[cls]);
+	}
+	return 1;
+}
+
+/*
+** Everything is kept up to date as the loop runs, this only copies it, cheap enough to
+** be called every second. With reset the counters and histograms start again from zero
+*/
+static int pulsar_loop_stats(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_metrics *m = &loop->metrics;
+	lua_newtable(L);
+	lua_pushnumber(L, m->accepts); lua_setfield(L, -2, "accepts");
+	lua_pushnumber(L, m->accept_errors); lua_setfield(L, -2, "accept_errors");
+	lua_pushnumber(L, m->bytes_read); lua_setfield(L, -2, "bytes_read");
+	lua_pushnumber(L, m->bytes_written); lua_setfield(L, -2, "bytes_written");
+	lua_pushnumber(L, m->clients); lua_setfield(L, -2, "clients");
+	lua_pushnumber(L, m->clients_total); lua_setfield(L, -2, "clients_total");
+	lua_pushnumber(L, m->writes_pending); lua_setfield(L, -2, "writes_pending");
+	lua_pushnumber(L, m->write_bytes_pending); lua_setfield(L, -2, "write_bytes_pending");
+	lua_pushnumber(L, m->timer_fires); lua_setfield(L, -2, "timer_fires");
+	lua_pushnumber(L, m->worker_queued); lua_setfield(L, -2, "worker_queued");
+
+	lua_newtable(L);
+	int i;
+	for (i = 0; i < PULSAR_RESUME_KINDS; i++) {
+		lua_pushnumber(L, m->resumes[i]);
+		lua_setfield(L, -2, metrics_resume_names[i]);
+	}
+	lua_setfield(L, -2, "resumes");
+
+	// Jobs waiting for a thread are counted by the pool's threads, this is only a snapshot
+	pulsar_spawn_pool *pool = loop->spawn_pool;
+	lua_pushnumber(L, m->spawns); lua_setfield(L, -2, "spawns");
+	lua_pushnumber(L, pool ? pool->pending : 0); lua_setfield(L, -2, "spawn_queued");
+	lua_pushnumber(L, pool ? pool->inflight : 0); lua_setfield(L, -2, "spawn_inflight");
+	hist_push(L, &m->spawn_wait); lua_setfield(L, -2, "spawn_wait");
+	hist_push(L, &m->spawn_run); lua_setfield(L, -2, "spawn_run");
+	lua_pushnumber(L, m->slow_resumes); lua_setfield(L, -2, "slow_resumes");
+	hist_push(L, &m->resume_time); lua_setfield(L, -2, "resume_time");
+	hist_push(L, &m->loop_lag); lua_setfield(L, -2, "loop_lag");
+
+	if (lua_toboolean(L, 2)) metrics_reset(m);
+	return 1;
+}
+
+/*
+** Turns the monitor on, unless enabled is false, with the given options and returns
+** its state along with the resume time and loop lag histograms
+*/
+static int pulsar_loop_monitor(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_monitor *mon = &loop->monitor;
+	if (lua_istable(L, 2)) {
+		uv_once(&monitor_once, monitor_key_init);
+		lua_getfield(L, 2, "enabled");
+		mon->enabled = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "threshold");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) >= 0)) mon->threshold = lua_tonumber(L, -1) * 1000000;
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "interval");
+		if (lua_isnumber(L, -1) && (lua_tonumber(L, -1) >= 1)) mon->interval = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "hook");
+		if (!lua_isnil(L, -1)) mon->hook = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "callback");
+		if (lua_isfunction(L, -1)) {
+			luaL_unref(L, LUA_REGISTRYINDEX, mon->cb_ref);
+			mon->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			if (!mon->L) {
+				mon->L = lua_newthread(L);
+				mon->L_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			}
+		} else {
+			if (!lua_isnil(L, -1)) {
+				luaL_unref(L, LUA_REGISTRYINDEX, mon->cb_ref);
+				mon->cb_ref = LUA_NOREF;
+			}
+			lua_pop(L, 1);
+		}
+
+		// The lag timer alone must not keep the loop running
+		if (!mon->lag_timer) {
+			mon->lag_timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+			uv_timer_init(loop->loop, mon->lag_timer);
+			mon->lag_timer->data = loop;
+			uv_unref((uv_handle_t*)mon->lag_timer);
+		}
+		uv_timer_stop(mon->lag_timer);
+		if (mon->enabled) {
+			mon->lag_last = uv_hrtime();
+			uv_timer_start(mon->lag_timer, monitor_lag_cb, mon->interval, mon->interval);
+		}
+	}
+
+	lua_newtable(L);
+	lua_pushboolean(L, mon->enabled); lua_setfield(L, -2, "enabled");
+	lua_pushnumber(L, mon->threshold / 1000000.0); lua_setfield(L, -2, "threshold");
+	lua_pushnumber(L, mon->interval); lua_setfield(L, -2, "interval");
+	lua_pushboolean(L, mon->hook); lua_setfield(L, -2, "hook");
+	lua_pushnumber(L, loop->metrics.slow_resumes); lua_setfield(L, -2, "slow_resumes");
+	hist_push(L, &loop->metrics.resume_time); lua_setfield(L, -2, "resume_time");
+	hist_push(L, &loop->metrics.loop_lag); lua_setfield(L, -2, "loop_lag");
+	return 1;
+}
+
+static int pulsar_loop_co_pool(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	pulsar_co_pool *pool = &loop->co_pool;
+	if (lua_isnumber(L, 2)) {
+		int max = lua_tonumber(L, 2);
+		pool->max = (max > 0) ? max : 0;
+		while (pool->nb > pool->max) {
+			pool->nb--;
+			luaL_unref(L, LUA_REGISTRYINDEX, pool->refs[pool->nb]);
+		}
+	}
+
+	lua_newtable(L);
+	lua_pushnumber(L, pool->nb); lua_setfield(L, -2, "size");
+	lua_pushnumber(L, pool->max); lua_setfield(L, -2, "max");
+	lua_pushnumber(L, pool->high_water); lua_setfield(L, -2, "high_water");
+	lua_pushnumber(L, pool->created); lua_setfield(L, -2, "created");
+	lua_pushnumber(L, pool->reused); lua_setfield(L, -2, "reused");
+	return 1;
+}
+
+static int pulsar_loop_spawn_pool(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "threads");
+		if (lua_isnumber(L, -1)) {
+			int threads = lua_tonumber(L, -1);
+			if (threads < 1) { lua_pushstring(L, "spawn pool needs at least one thread"); lua_error(L); return 0; }
+			if (loop->spawn_pool && (threads != loop->spawn_pool->nthreads)) {
+				lua_pushnil(L);
+				lua_pushliteral(L, "spawn pool already started");
+				return 2;
+			}
+			loop->spawn_threads = threads;
+		}
+		lua_pop(L, 1);
+	}
+
+	pulsar_spawn_pool *pool = loop->spawn_pool;
+	int i, prio;
+	const char *names[SPAWN_PRIORITIES] = { "high", "low" };
+	lua_newtable(L);
+	lua_pushnumber(L, pool ? pool->nthreads : loop->spawn_threads); lua_setfield(L, -2, "threads");
+	if (!pool) return 1;
+
+	uv_mutex_lock(&pool->lock);
+	lua_pushnumber(L, pool->pending); lua_setfield(L, -2, "queued");
+	uv_mutex_unlock(&pool->lock);
+	lua_pushnumber(L, pool->max_queued); lua_setfield(L, -2, "max_queued");
+	lua_pushnumber(L, pool->inflight); lua_setfield(L, -2, "inflight");
+
+	// Wait times, from the call to a thread starting it, are in milliseconds
+	for (prio = 0; prio < SPAWN_PRIORITIES; prio++) {
+		lua_newtable(L);
+		lua_pushnumber(L, pool->submitted[prio]); lua_setfield(L, -2, "submitted");
+		lua_pushnumber(L, pool->completed[prio]); lua_setfield(L, -2, "completed");
+		lua_pushnumber(L, pool->completed[prio] ? pool->wait_total[prio] / 1e6 / pool->completed[prio] : 0); lua_setfield(L, -2, "wait_avg");
+		lua_pushnumber(L, pool->wait_max[prio] / 1e6); lua_setfield(L, -2, "wait_max");
+		lua_setfield(L, -2, names[prio]);
+	}
+
+	lua_createtable(L, pool->nthreads, 0);
+	for (i = 0; i < pool->nthreads; i++) {
+		lua_newtable(L);
+		lua_pushnumber(L, pool->workers[i].executed); lua_setfield(L, -2, "executed");
+		lua_pushnumber(L, pool->workers[i].stolen); lua_setfield(L, -2, "stolen");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "workers");
+	return 1;
+}
+
+static int pulsar_loop_read_size(lua_State *L)
+{
+	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
+	if (lua_isnumber(L, 2)) {
+		int size = lua_tonumber(L, 2);
+		if (size < 1) { lua_pushstring(L, "read size must be positive"); lua_error(L); return 0; }
+		loop->read_size = size;
+	}
+	lua_pushnumber(L, loop->read_size);
+	return 1;
+}
+
 static int pulsar_loop_run(lua_State *L)
 {
 	pulsar_loop *loop = (pulsar_loop *)luaL_checkudata (L, 1, MT_PULSAR_LOOP);
@@ -1135,11 +5541,29 @@ static const struct luaL_reg meth_pulsar_loop[] =
 	{"run", pulsar_loop_run},
 	{"tcpServer", pulsar_tcp_server_new},
 	{"tcpClient", pulsar_tcp_client_new},
+	{"pipeServer", pulsar_pipe_server_new},
+	{"pipeClient", pulsar_pipe_client_new},
+	{"udp", pulsar_udp_new},
+	{"connectionPool", pulsar_conn_pool_new},
+	{"stats", pulsar_loop_stats},
+	{"monitor", pulsar_loop_monitor},
+	{"resolve", pulsar_loop_resolve},
+	{"fsOpen", pulsar_fs_open},
+	{"fsRead", pulsar_fs_read},
+	{"fsWrite", pulsar_fs_write},
+	{"fsStat", pulsar_fs_stat},
+	{"fsClose", pulsar_fs_close},
+	{"dnsCache", pulsar_loop_dns_cache},
 	{"timer", pulsar_timer_new},
 	{"idle", pulsar_idle_new},
 	{"worker", pulsar_idle_worker_new},
 	{"longTask", pulsar_idle_worker_new},
 	{"spawn", pulsar_spawn_new},
+	{"readSize", pulsar_loop_read_size},
+	{"spawnPool", pulsar_loop_spawn_pool},
+	{"sleep", pulsar_loop_sleep},
+	{"coroutinePool", pulsar_loop_co_pool},
+	{"scheduler", pulsar_loop_scheduler},
 	{"close", pulsar_loop_close},
 	{"__gc", pulsar_loop_close},
 	{NULL, NULL},
@@ -1166,6 +5590,7 @@ static const struct luaL_reg meth_pulsar_idle_worker[] =
 {
 	{"register", pulsar_idle_worker_register},
 	{"split", pulsar_idle_worker_split},
+	{"budget", pulsar_idle_worker_budget},
 	{"close", pulsar_idle_worker_close},
 	{"__gc", pulsar_idle_worker_close},
 	{NULL, NULL},
@@ -1173,9 +5598,40 @@ static const struct luaL_reg meth_pulsar_idle_worker[] =
 static const struct luaL_reg meth_pulsar_spawn[] =
 {
 	{"__call", pulsar_spawn_call},
+	{"map", pulsar_spawn_map},
+	{"batch", pulsar_spawn_batch},
 	{"__gc", pulsar_spawn_free},
 	{NULL, NULL},
 };
+static const struct luaL_reg meth_pulsar_cluster[] =
+{
+	{"wait", pulsar_cluster_wait},
+	{"stats", pulsar_cluster_stats},
+	{"__gc", pulsar_cluster_free},
+	{NULL, NULL},
+};
+static const struct luaL_reg meth_pulsar_udp[] =
+{
+	{"recv", pulsar_udp_recv},
+	{"recvBatch", pulsar_udp_recv_batch},
+	{"sendTo", pulsar_udp_send_to},
+	{"sendBatch", pulsar_udp_send_batch},
+	{"getsockname", pulsar_udp_getsockname},
+	{"stats", pulsar_udp_stats},
+	{"close", pulsar_udp_close},
+	{"__gc", pulsar_udp_close},
+	{NULL, NULL},
+};
+static const struct luaL_reg meth_pulsar_conn_pool[] =
+{
+	{"acquire", pulsar_conn_pool_acquire},
+	{"release", pulsar_conn_pool_release},
+	{"stats", pulsar_conn_pool_stats},
+	{"close", pulsar_conn_pool_close},
+	{"__gc", pulsar_conn_pool_free},
+	{NULL, NULL},
+};
+
 static const struct luaL_reg meth_pulsar_tcp_server[] =
 {
 	{"start", pulsar_tcp_server_start},
@@ -1192,6 +5648,13 @@ static const struct luaL_reg meth_pulsar_tcp_client[] =
 	{"recvUntil", pulsar_tcp_client_read_until},
 	{"readUntil", pulsar_tcp_client_read_until},
 	{"send", pulsar_tcp_client_send},
+	{"writeQueueSize", pulsar_tcp_client_write_queue_size},
+	{"setWaterMarks", pulsar_tcp_client_set_water_marks},
+	{"drain", pulsar_tcp_client_drain},
+	{"setTimeouts", pulsar_tcp_client_set_timeouts},
+	{"setPriority", pulsar_tcp_client_set_priority},
+	{"sendFile", pulsar_tcp_client_send_file},
+	{"pipeTo", pulsar_tcp_client_pipe_to},
 	{"connected", pulsar_tcp_client_is_connected},
 	{"hasData", pulsar_tcp_client_has_data},
 	{"getpeername", pulsar_tcp_client_getpeername},
@@ -1200,10 +5663,27 @@ static const struct luaL_reg meth_pulsar_tcp_client[] =
 	{NULL, NULL},
 };
 
+static const struct luaL_reg meth_pulsar_buffer[] =
+{
+	{"len", pulsar_buffer_len},
+	{"capacity", pulsar_buffer_capacity},
+	{"append", pulsar_buffer_append},
+	{"clear", pulsar_buffer_clear},
+	{"tostring", pulsar_buffer_tostring},
+	{"__len", pulsar_buffer_len},
+	{"__tostring", pulsar_buffer_tostring},
+	{"__gc", pulsar_buffer_free},
+	{NULL, NULL},
+};
+
 static const struct luaL_reg pulsarlib[] =
 {
 	{"defaultLoop", pulsar_loop_default},
 	{"newLoop", pulsar_loop_new},
+	{"cluster", pulsar_cluster_new},
+	{"buffer", pulsar_buffer_new},
+	{"encode", pulsar_serial_encode},
+	{"decode", pulsar_serial_decode},
 	{NULL, NULL},
 };
 
@@ -1228,6 +5708,11 @@ static void pulsar_createmeta(lua_State *L, const char *name, const luaL_Reg *me
 	lua_pop(L, 1);
 }
 
+// Spawn states get the buffer metatable too so buffers can be passed to them
+static void buffer_createmeta(lua_State *L) {
+	pulsar_createmeta(L, MT_PULSAR_BUFFER, meth_pulsar_buffer);
+}
+
 /*
 ** Assumes the table is on top of the stack.
 */
@@ -1252,7 +5737,11 @@ int luaopen_pulsar(lua_State *L)
 	pulsar_createmeta(L, MT_PULSAR_IDLE_WORKER, meth_pulsar_idle_worker);
 	pulsar_createmeta(L, MT_PULSAR_TCP_SERVER, meth_pulsar_tcp_server);
 	pulsar_createmeta(L, MT_PULSAR_TCP_CLIENT, meth_pulsar_tcp_client);
+	pulsar_createmeta(L, MT_PULSAR_UDP, meth_pulsar_udp);
+	pulsar_createmeta(L, MT_PULSAR_CONN_POOL, meth_pulsar_conn_pool);
 	pulsar_createmeta(L, MT_PULSAR_SPAWN, meth_pulsar_spawn);
+	pulsar_createmeta(L, MT_PULSAR_CLUSTER, meth_pulsar_cluster);
+	buffer_createmeta(L);
 
 	luaL_openlib(L, "pulsar", pulsarlib, 0);
 	set_info(L);
@@ -6,16 +6,23 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <strings.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <uv.h>
 #include <lua.h>
 #include <lauxlib.h>
@@ -31,21 +38,355 @@
 #define MT_PULSAR_TCP_SERVER	"Pulsar TCP Server"
 #define MT_PULSAR_TCP_CLIENT	"Pulsar TCP Client"
 #define MT_PULSAR_SPAWN		"Pulsar Spawn"
+#define MT_PULSAR_CLUSTER	"Pulsar Cluster"
+#define MT_PULSAR_BUFFER	"Pulsar Buffer"
+#define MT_PULSAR_UDP		"Pulsar UDP"
+#define MT_PULSAR_CONN_POOL	"Pulsar Connection Pool"
 
 /**************************************************************************************
- ** Loop
+ ** Buffers
+ **************************************************************************************/
+#define PULSAR_POOL_MIN_SHIFT	10
+#define PULSAR_POOL_CLASSES	11
+#define PULSAR_POOL_MAX_FREE	64
+
+struct pulsar_buffer_slab
+{
+	struct pulsar_buffer_slab *next;
+};
+typedef struct pulsar_buffer_slab pulsar_buffer_slab;
+
+typedef struct
+{
+	pulsar_buffer_slab *free[PULSAR_POOL_CLASSES];
+	int nb_free[PULSAR_POOL_CLASSES];
+	size_t hits, misses;
+} pulsar_buffer_pool;
+
+typedef struct
+{
+	char *buf;
+	size_t buflen;
+	size_t rpos, wpos;
+} pulsar_read_buffer;
+
+// Byte buffer owned by Lua, pinned while a read or a write uses its memory
+typedef struct
+{
+	char *data;
+	size_t len, cap;
+	int pins;
+} pulsar_buffer;
+
+/**************************************************************************************
+ ** Coroutines
+ **************************************************************************************/
+#define PULSAR_CO_POOL_MAX	1024
+
+typedef struct
+{
+	lua_State **threads;
+	int *refs;
+	int nb, size, max;
+	int high_water;
+	size_t created, reused;
+} pulsar_co_pool;
+
+// What resumed a coroutine, its kind is one of PULSAR_RESUME_* and ptr the client, timer or idle,
+// or the task record for a worker
+typedef struct
+{
+	int kind;
+	void *ptr;
+	lua_State *L;
+} pulsar_owner;
+
+/**************************************************************************************
+ ** Cluster
+ **************************************************************************************/
+typedef struct
+{
+	uv_thread_t thread;
+	int id, nthreads;
+
+	char *code;
+	size_t code_len;
+	char *script;
+
+	bool started;
+	volatile bool running;
+
+	// Written only by the thread's own loop, read without locking by the cluster
+	volatile size_t accepts, accept_errors, clients;
+} pulsar_cluster_thread;
+
+typedef struct
+{
+	pulsar_cluster_thread *threads;
+	int nthreads;
+	bool joined;
+} pulsar_cluster;
+
+/**************************************************************************************
+ ** Timer wheel
+ **************************************************************************************/
+#define PULSAR_WHEEL_LEVELS	4
+#define PULSAR_WHEEL_BITS	8
+#define PULSAR_WHEEL_SLOTS	(1 << PULSAR_WHEEL_BITS)
+#define PULSAR_WHEEL_MASK	(PULSAR_WHEEL_SLOTS - 1)
+
+struct pulsar_wheel_node_s;
+typedef void (*pulsar_wheel_cb)(struct pulsar_wheel_node_s *node);
+
+// Embedded in whatever needs a deadline, expires is in loop milliseconds
+struct pulsar_wheel_node_s
+{
+	struct pulsar_wheel_node_s *next, **pprev;
+	uint64_t expires;
+	unsigned char level, slot;
+	bool active;
+	pulsar_wheel_cb cb;
+	void *data;
+};
+typedef struct pulsar_wheel_node_s pulsar_wheel_node;
+
+typedef struct
+{
+	uv_timer_t timer;
+	uint64_t now;
+	uint64_t scheduled;
+	pulsar_wheel_node *slots[PULSAR_WHEEL_LEVELS][PULSAR_WHEEL_SLOTS];
+	uint64_t bitmap[PULSAR_WHEEL_LEVELS][PULSAR_WHEEL_SLOTS / 64];
+	int nb[PULSAR_WHEEL_LEVELS];
+} pulsar_wheel;
+
+typedef struct
+{
+	pulsar_wheel_node node;
+	struct pulsar_loop_s *loop;
+	lua_State *L;
+	int L_ref;
+	pulsar_owner owner;
+} pulsar_sleep;
+
+/**************************************************************************************
+ ** Scheduler
+ **************************************************************************************/
+#define PULSAR_CLASS_HIGH	0
+#define PULSAR_CLASS_NORMAL	1
+#define PULSAR_CLASS_BULK	2
+#define PULSAR_CLASSES		3
+
+#define PULSAR_SCHED_BUDGET	2
+#define PULSAR_SCHED_QUANTUM	16
+#define PULSAR_SCHED_POOL_MAX	1024
+
+// Run with the coroutine to resume, if any, and the number of values pushed for it
+typedef void (*pulsar_task_cb)(void *data, lua_State *L, int nargs);
+
+struct pulsar_task_s
+{
+	struct pulsar_task_s *next;
+	pulsar_task_cb cb;
+	void *data;
+	lua_State *L;
+	int L_ref;
+	int nargs;
+	int cls;
+	uint64_t queued_at;
+};
+typedef struct pulsar_task_s pulsar_task;
+
+/*
+** Once enabled wakeups are queued per priority class instead of resuming from inside libuv
+** callbacks, and drained before and after polling until the per tick budget is spent
+*/
+typedef struct
+{
+	bool enabled;
+	uint64_t budget;
+	int quantum;
+
+	pulsar_task *head[PULSAR_CLASSES], *tail[PULSAR_CLASSES];
+	int nb[PULSAR_CLASSES];
+	pulsar_task *free;
+	int nb_free;
+
+	uv_prepare_t prepare;
+	uv_check_t check;
+	uv_idle_t idle;
+	bool running;
+
+	size_t ticks, exhausted;
+	size_t queued[PULSAR_CLASSES], ran[PULSAR_CLASSES];
+	uint64_t wait_total[PULSAR_CLASSES], wait_max[PULSAR_CLASSES];
+} pulsar_scheduler;
+
+/**************************************************************************************
+ ** DNS
  **************************************************************************************/
+#define PULSAR_DNS_BUCKETS	256
+#define PULSAR_DNS_MAX		1024
+#define PULSAR_DNS_TTL		60
+
+// Addresses a host name resolved to, ports are set by whoever uses them
+struct pulsar_dns_entry_s
+{
+	struct pulsar_dns_entry_s *next;
+	char *host;
+	struct sockaddr_storage *addrs;
+	int nb;
+	uint64_t expires;
+};
+typedef struct pulsar_dns_entry_s pulsar_dns_entry;
+
 typedef struct
+{
+	pulsar_dns_entry **buckets;
+	int nb, max;
+	uint64_t ttl;
+	size_t hits, misses, failures;
+} pulsar_dns_cache;
+
+struct pulsar_resolve_s;
+typedef void (*pulsar_resolve_cb)(void *data, int status, struct sockaddr_storage *addrs, int nb);
+
+typedef struct pulsar_resolve_s
+{
+	uv_getaddrinfo_t req;
+	struct pulsar_loop_s *loop;
+	char *host;
+	pulsar_resolve_cb cb;
+	void *data;
+} pulsar_resolve;
+
+// Coroutine waiting in loop:resolve
+typedef struct
+{
+	struct pulsar_loop_s *loop;
+	lua_State *L;
+	int L_ref;
+	pulsar_owner owner;
+} pulsar_resolve_wait;
+
+/**************************************************************************************
+ ** Metrics
+ **************************************************************************************/
+/*
+** Counters are only touched by the loop's thread so they need no locks, histograms
+** count durations in power of two buckets of microseconds
+*/
+#define PULSAR_HIST_BUCKETS	32
+
+typedef struct
+{
+	uint64_t count, sum, max;
+	uint64_t buckets[PULSAR_HIST_BUCKETS];
+} pulsar_histogram;
+
+#define PULSAR_RESUME_CLIENT	0
+#define PULSAR_RESUME_TIMER	1
+#define PULSAR_RESUME_IDLE	2
+#define PULSAR_RESUME_WORKER	3
+#define PULSAR_RESUME_SPAWN	4
+#define PULSAR_RESUME_TASK	5
+#define PULSAR_RESUME_KINDS	6
+
+typedef struct
+{
+	uint64_t accepts, accept_errors;
+	uint64_t bytes_read, bytes_written;
+	uint64_t clients_total;
+	int64_t clients;
+	int64_t writes_pending, write_bytes_pending;
+	uint64_t resumes[PULSAR_RESUME_KINDS];
+	uint64_t timer_fires;
+	int64_t worker_queued;
+	uint64_t spawns;
+	pulsar_histogram spawn_wait, spawn_run;
+	uint64_t slow_resumes;
+	pulsar_histogram resume_time, loop_lag;
+} pulsar_metrics;
+
+/*
+** With the monitor on each resume is timed, and a count hook notes where the coroutine
+** was once it ran past the threshold. A repeating timer measures how late the loop is
+*/
+#define PULSAR_MONITOR_THRESHOLD	50
+#define PULSAR_MONITOR_INTERVAL		100
+#define PULSAR_MONITOR_HOOK_COUNT	10000
+#define PULSAR_MONITOR_TRACE		1024
+
+typedef struct
+{
+	bool enabled;
+	bool hook;
+	uint64_t threshold;
+	uint64_t interval;
+
+	// Slow resumes are reported to the callback, run on a thread of its own
+	lua_State *L;
+	int L_ref;
+	int cb_ref;
+	bool reporting;
+
+	uv_timer_t *lag_timer;
+	uint64_t lag_last;
+} pulsar_monitor;
+
+// Resumes in progress, innermost first, the count hook looks for its coroutine's
+typedef struct pulsar_resume_frame_s
+{
+	struct pulsar_loop_s *loop;
+	lua_State *L;
+	int kind;
+	uint64_t start;
+	bool traced;
+	char trace[PULSAR_MONITOR_TRACE];
+	struct pulsar_resume_frame_s *prev;
+} pulsar_resume_frame;
+
+/**************************************************************************************
+ ** Loop
+ **************************************************************************************/
+typedef struct pulsar_loop_s
 {
 	uv_loop_t *loop;
+
+	pulsar_wheel wheel;
+	pulsar_scheduler sched;
+	pulsar_dns_cache dns;
+
+	pulsar_buffer_pool pool;
+	size_t read_size;
+
+	pulsar_co_pool co_pool;
+
+	pulsar_cluster_thread *cluster;
+
+	struct pulsar_spawn_pool_s *spawn_pool;
+	int spawn_threads;
+
+	pulsar_metrics metrics;
+	pulsar_monitor monitor;
+
+	// Coroutine being resumed, the waits it starts end through its owner
+	pulsar_owner resuming;
 } pulsar_loop;
 
 /**************************************************************************************
  ** Idlers
  **************************************************************************************/
+/*
+** With an interval idlers and workers do not spin on an idle handle, they run after I/O
+** from a check handle and a wheel node wakes the loop up every interval ms
+*/
 typedef struct
 {
 	uv_idle_t *w_timeout;
+	uv_check_t *w_check;
+	pulsar_wheel_node wake;
+	uint64_t interval;
 	
 	pulsar_loop *loop;
 
@@ -53,26 +394,50 @@ typedef struct
 
 	bool active;
 	bool first_run;
+	bool queued;
 	int co_ref;
 } pulsar_idle;
 
+// A task's record stays with its coroutine from register until it returns, split and waits included
 struct pulsar_idle_worker_chain
 {
+	struct pulsar_idle_worker_s *worker;
 	lua_State *L;
 	int L_ref;
 	int nargs;
+	bool owned;
+	// Set when a split or a wait will queue it again after it yields
+	bool held;
 	struct pulsar_idle_worker_chain *next;
 };
 typedef struct pulsar_idle_worker_chain pulsar_idle_worker_chain;
 
-typedef struct
+#define PULSAR_WORKER_BUDGET	1
+#define PULSAR_WORKER_POOL_MAX	256
+
+typedef struct pulsar_idle_worker_s
 {
 	uv_idle_t *w_timeout;
+	uv_check_t *w_check;
+	pulsar_wheel_node wake;
+	uint64_t interval;
 	
 	pulsar_loop *loop;
 
 	bool active;
-	pulsar_idle_worker_chain *chain;
+	bool queued;
+
+	// FIFO of tasks to resume, with spare nodes kept for the next splits
+	pulsar_idle_worker_chain *chain, *chain_tail;
+	pulsar_idle_worker_chain *free_chain;
+	int nb_free;
+
+	// Time in ns each idle callback may spend resuming tasks
+	uint64_t budget;
+
+	// Task being resumed and when its slice started
+	pulsar_idle_worker_chain *current;
+	uint64_t slice_start;
 } pulsar_idle_worker;
 
 /**************************************************************************************
@@ -88,23 +453,135 @@ typedef struct pulsar_spawn_ret_s pulsar_spawn_ret;
 
 typedef struct
 {
-	uv_work_t work;
+	pulsar_spawn_ret *out;
+	int seen;
+	int ntables;
+	bool transfer;
+} pulsar_encoder;
+
+// Read cursor over data produced by pulsar_encode
+typedef struct
+{
+	const char *buf;
+	size_t pos, len;
+	int depth;
+	int ntables;
+	bool transfer;
+} pulsar_decoder;
+
+// Compiled function shared by a spawn and its calls in flight, only touched by the loop's thread
+typedef struct
+{
+	unsigned int id;
+	char *fctcode;
+	size_t fctcode_len;
+	char *initcode;
+	size_t initcode_len;
+	int recycle;
+	int priority;
+	int refs;
+} pulsar_spawn_code;
+
+// Lua state kept by each worker thread, with the functions it already loaded
+typedef struct
+{
+	lua_State *L;
+	int cache_ref;
+	int cached;
+	int calls;
+} pulsar_spawn_state;
+
+#define SPAWN_CALL	0
+#define SPAWN_MAP	1
+#define SPAWN_BATCH	2
+
+// Chunks of a map or batch call, the coroutine is resumed once they all finished
+typedef struct
+{
+	lua_State *L;
+	int L_ref;
+	int results_ref;
+	int timings_ref;
+	int err_ref;
+	int pending;
+	bool failed;
+} pulsar_spawn_group;
+
+struct pulsar_spawn_s
+{
+	struct pulsar_spawn_s *next, *prev;
 	
 	lua_State *L;
 	int L_ref;
 
-	char *fctcode;
-	size_t fctcode_len;
+	pulsar_spawn_code *code;
 	pulsar_spawn_ret arg;
 
 	pulsar_spawn_ret ret;
-} pulsar_spawn;
+	bool failed;
+
+	int mode;
+	pulsar_spawn_group *group;
+	int chunk, first, count;
+	int priority;
+	uint64_t queued_at, started_at, finished_at;
+};
+typedef struct pulsar_spawn_s pulsar_spawn;
+
+/*
+** Spawns run on a thread pool owned by the loop, each thread has a deque per priority
+** that it takes from first and that idle threads steal from
+*/
+#define SPAWN_PRIORITY_HIGH	0
+#define SPAWN_PRIORITY_LOW	1
+#define SPAWN_PRIORITIES	2
+#define SPAWN_DEFAULT_THREADS	4
+
+typedef struct
+{
+	uv_mutex_t lock;
+	pulsar_spawn *head[SPAWN_PRIORITIES], *tail[SPAWN_PRIORITIES];
+	int nb[SPAWN_PRIORITIES];
+} pulsar_spawn_deque;
 
 typedef struct
+{
+	uv_thread_t thread;
+	struct pulsar_spawn_pool_s *pool;
+	int id;
+	pulsar_spawn_deque deque;
+	volatile size_t executed, stolen;
+} pulsar_spawn_worker;
+
+struct pulsar_spawn_pool_s
 {
 	pulsar_loop *loop;
-	char *fctcode;
-	size_t fctcode_len;
+	pulsar_spawn_worker *workers;
+	int nthreads;
+	int next;
+
+	// Jobs queued and not yet taken by a thread, threads sleep while there are none
+	uv_mutex_t lock;
+	uv_cond_t cond;
+	int pending;
+	bool stopping;
+
+	// Finished jobs waiting for the loop's thread
+	uv_mutex_t done_lock;
+	pulsar_spawn *done;
+	uv_async_t async;
+	int inflight;
+
+	int max_queued;
+	size_t submitted[SPAWN_PRIORITIES], completed[SPAWN_PRIORITIES];
+	uint64_t wait_total[SPAWN_PRIORITIES], wait_max[SPAWN_PRIORITIES];
+};
+typedef struct pulsar_spawn_pool_s pulsar_spawn_pool;
+
+typedef struct
+{
+	pulsar_loop *loop;
+	pulsar_spawn_code *code;
 } pulsar_spawn_base;
 
 /**************************************************************************************
@@ -112,7 +589,7 @@ typedef struct
  **************************************************************************************/
 typedef struct
 {
-	uv_timer_t *w_timeout;
+	pulsar_wheel_node node;
 	
 	pulsar_loop *loop;
 
@@ -120,17 +597,20 @@ typedef struct
 
 	bool active;
 	bool first_run;
+	bool queued;
 	int co_ref;
 
-	int timeout, repeat;
+	uint64_t timeout, repeat;
 } pulsar_timer;
 
 /**************************************************************************************
  ** TCP
  **************************************************************************************/
+// Servers and clients work on any stream, a TCP socket or a unix domain socket for pipes
 typedef struct
 {
-	uv_tcp_t *sock;
+	uv_stream_t *sock;
+	bool pipe;
 	
 	pulsar_loop *loop;
 
@@ -138,16 +618,40 @@ typedef struct
 
 	bool active;
 	int client_fct_ref;
+
+	uint64_t read_timeout, write_timeout;
+	int priority;
 } pulsar_tcp_server;
 
 typedef struct
 {
-	uv_tcp_t *sock;
+	bool reuseport;
+	uint64_t read_timeout, write_timeout;
+	int priority;
+} pulsar_tcp_server_opts;
+
+// A server waiting for its host name to resolve
+typedef struct
+{
+	pulsar_loop *loop;
+	lua_State *L;
+	int L_ref;
+	pulsar_owner owner;
+	int fct_ref;
+	int port;
+	pulsar_tcp_server_opts opts;
+} pulsar_tcp_server_resolve;
+
+typedef struct pulsar_tcp_client_s
+{
+	uv_stream_t *sock;
+	bool pipe;
 
 	pulsar_loop *loop;
 
 	bool standalone;
 
+	lua_State *co;
 	int co_ref;
 
 	bool closed;
@@ -156,26 +660,91 @@ typedef struct
 
 	size_t read_wait_len;
 	char *read_wait_until;
+	size_t read_wait_untillen;
+	size_t read_wait_scanned;
 	size_t read_wait_ignorelen;
 	char *read_wait_ignore;
 
 	lua_State *rL;
 	int rL_ref;
-	char *read_buf;
-	size_t read_buf_len, read_buf_pos;
+	pulsar_read_buffer read_buf;
+	pulsar_buffer *read_target;
+	int read_target_ref;
+	bool read_direct;
+
+	size_t write_high, write_low;
+	size_t write_wait;
+	bool write_wait_drain;
+	lua_State *wL;
+	int wL_ref;
+
+	// Timeouts in ms, 0 to wait forever
+	uint64_t read_timeout, write_timeout;
+	pulsar_wheel_node read_node, write_node;
+	int write_blocked;
+	const char *close_reason;
+
+	// Scheduler class, and reads served without waiting since last resumed
+	int priority;
+	int sched_reads;
+
+	// File being sent, it stops once its read or write in progress is done
+	struct pulsar_sendfile_s *sendfile;
+	bool sendfile_cancel;
+
+	// Forwarding all that is read to another client, or receiving from one
+	struct pulsar_splice_s *splice_out;
+	struct pulsar_splice_s *splice_in;
+
+	// Connection pool the client counts in
+	struct pulsar_conn_pool_s *pool;
 } pulsar_tcp_client;
 
+/*
+** Data read from src is handed to dst's write queue without going through Lua, reads
+** pause while more than bufsize bytes wait to be written
+*/
+#define PULSAR_SPLICE_BUFSIZE	(256 * 1024)
+
+typedef struct pulsar_splice_s
+{
+	pulsar_loop *loop;
+	pulsar_tcp_client *src, *dst;
+	int src_ref, dst_ref;
+
+	lua_State *L;
+	int L_ref;
+
+	size_t bufsize;
+	uint64_t bytes;
+	bool paused;
+	bool done;
+	int writes;
+} pulsar_splice;
+
+typedef struct
+{
+	uv_write_t req;
+	pulsar_splice *splice;
+	char *buf;
+	size_t size;
+	size_t len;
+} pulsar_splice_write;
+
 typedef struct
 {
 	uv_write_t req;
 
 	uv_buf_t buf;
+	size_t total;
+	pulsar_buffer *buffer;
 
 	pulsar_tcp_client *client;
 
 	lua_State *sL;
 	int sL_ref;
 	int data_ref;
+	int client_ref;
 
 	bool nowait;
 } pulsar_tcp_client_send_chain;
@@ -186,10 +755,188 @@ typedef struct
 
 	pulsar_loop *loop;
 
-	uv_tcp_t *sock;
+	uv_stream_t *sock;
 
 	lua_State *L;
 	int L_ref;
+	pulsar_owner owner;
+
+	pulsar_wheel_node node;
+	bool timed_out;
+	uint64_t read_timeout, write_timeout;
+
+	// Addresses to try in turn, resolved unless the host was numeric
+	pulsar_resolve *resolve;
+	struct sockaddr_storage *addrs;
+	int nb_addrs, next_addr;
+	int port;
+
+	// Connecting on behalf of a connection pool
+	struct pulsar_conn_pool_s *pool;
 } pulsar_tcp_client_connect;
 
+/*
+** Connection pools keep connected clients to one host and port for reuse, idle ones in
+** a stack so the most recently used, the likeliest to still be alive, goes out first
+*/
+#define PULSAR_CONN_POOL_MAX		16
+#define PULSAR_CONN_POOL_IDLE_TIMEOUT	60000
+
+typedef struct
+{
+	pulsar_tcp_client *client;
+	int client_ref;
+	uint64_t since;
+} pulsar_conn_pool_idle;
+
+typedef struct pulsar_conn_pool_waiter_s
+{
+	lua_State *L;
+	int L_ref;
+	pulsar_owner owner;
+	struct pulsar_conn_pool_waiter_s *next;
+} pulsar_conn_pool_waiter;
+
+typedef struct pulsar_conn_pool_s
+{
+	pulsar_loop *loop;
+	lua_State *L;
+	int L_ref;
+	// Held while clients are out, connecting or waited for
+	int self_ref;
+	bool waking;
+
+	char *host;
+	int port;
+	uint64_t connect_timeout, read_timeout, write_timeout;
+
+	// Connected or connecting clients, never more than max
+	int total, max;
+	pulsar_conn_pool_idle *idle;
+	int nb_idle;
+	uint64_t idle_timeout;
+	pulsar_wheel_node sweep;
+
+	pulsar_conn_pool_waiter *wait_head, *wait_tail;
+	int nb_waiting;
+
+	bool closed;
+	size_t hits, misses, waits, discarded, expired;
+} pulsar_conn_pool;
+
+/**************************************************************************************
+ ** Files
+ **************************************************************************************/
+#define PULSAR_FS_OPEN		0
+#define PULSAR_FS_READ		1
+#define PULSAR_FS_WRITE		2
+#define PULSAR_FS_STAT		3
+#define PULSAR_FS_CLOSE		4
+
+typedef struct
+{
+	uv_fs_t req;
+	int op;
+
+	pulsar_loop *loop;
+	lua_State *L;
+	int L_ref;
+	pulsar_owner owner;
+
+	// Read destination, or the data being written kept referenced
+	char *buf;
+	size_t len;
+	pulsar_buffer *buffer;
+	int data_ref;
+} pulsar_fs_req;
+
+#define PULSAR_SENDFILE_CHUNK	(256 * 1024)
+
+// File read in chunks by libuv's pool and written to a socket by the loop
+typedef struct pulsar_sendfile_s
+{
+	uv_work_t req;
+	uv_write_t wreq;
+
+	struct pulsar_tcp_client_s *client;
+	int client_ref;
+	lua_State *L;
+	int L_ref;
+
+	char *path;
+	int fd;
+	// Where the next read starts and how much is left to read, -1 until the size is known
+	int64_t offset;
+	int64_t len;
+
+	// One buffer is read into while the other is written
+	char *bufs[2];
+	size_t bufsize;
+	size_t blen[2];
+	int rbuf, wbuf;
+	bool reading, writing, eof;
+	ssize_t nread;
+
+	int64_t sent;
+	int err;
+} pulsar_sendfile;
+
+/**************************************************************************************
+ ** UDP
+ **************************************************************************************/
+// recvmmsg support came with libuv 1.40, older versions receive a datagram per call
+#if defined(UV_VERSION_HEX) && (UV_VERSION_HEX >= 0x012800)
+#define PULSAR_UDP_MMSG
+#endif
+
+#define PULSAR_UDP_DGRAM_MAX	(64 * 1024)
+#define PULSAR_UDP_BATCH	32
+#define PULSAR_UDP_QUEUE	1024
+
+// Received datagram, stored in a slab of the loop's buffer pool
+struct pulsar_udp_packet_s
+{
+	struct pulsar_udp_packet_s *next;
+	size_t size;
+	size_t len;
+	struct sockaddr_storage addr;
+	char data[];
+};
+typedef struct pulsar_udp_packet_s pulsar_udp_packet;
+
+typedef struct
+{
+	uv_udp_t *sock;
+
+	pulsar_loop *loop;
+
+	bool closed;
+
+	// Every receive lands here and is copied out, with recvmmsg it holds a whole batch
+	char *recv_buf;
+	size_t recv_buflen;
+	bool mmsg;
+
+	pulsar_udp_packet *head, *tail;
+	int nb, max;
+	size_t received, dropped;
+
+	// Coroutine waiting in recv, or in recvBatch for up to wait_batch datagrams
+	lua_State *rL;
+	int rL_ref;
+	pulsar_owner r_owner;
+	int wait_batch;
+} pulsar_udp;
+
+typedef struct
+{
+	uv_udp_send_t req;
+
+	pulsar_buffer *buffer;
+
+	lua_State *L;
+	int L_ref;
+	int data_ref;
+} pulsar_udp_send;
+
 #endif